@@ -0,0 +1,9 @@
+#!/bin/bash
+gcc -O2 -o exercisesoftwaredisk exercisesoftwaredisk.c softwaredisk.c && ./exercisesoftwaredisk bench
+gcc -O2 -o benchalloc benchalloc.c filesystem.c softwaredisk.c && ./benchalloc
+
+# AVX2 bitmap scan, only where the CPU has it
+grep -qw avx2 /proc/cpuinfo && gcc -O2 -mavx2 -o benchalloc-avx2 benchalloc.c filesystem.c softwaredisk.c && ./benchalloc-avx2
+gcc -O2 -o formatfs formatfs.c softwaredisk.c filesystem.c && gcc -O2 -o benchread benchread.c filesystem.c softwaredisk.c && ./formatfs && ./benchread
+gcc -O2 -o benchwrite benchwrite.c filesystem.c softwaredisk.c && ./formatfs && ./benchwrite
+gcc -O2 -pthread -o benchthreads benchthreads.c filesystem.c softwaredisk.c && ./formatfs && ./benchthreads
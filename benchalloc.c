@@ -0,0 +1,113 @@
+//
+// Microbenchmark for the free block allocator in filesystem.c.  Fills
+// the in-memory bitmap to increasing levels and times how long
+// findFreeDataSpace() takes to find a free block, next to the original
+// bit-at-a-time scan.  Doesn't touch the software disk.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+#define ALLOCATIONS 100000
+#define FIRST_DATA_BLOCK 128
+
+// Also have to redeclare it here to use
+typedef struct FreeBitmap
+{
+    unsigned char map[SOFTWARE_DISK_BLOCK_SIZE];
+} FreeBitmap;
+
+extern FreeBitmap bitmap; // need this so we can use it here
+
+int16_t findFreeDataSpace(void);
+void reset_allocator(void);
+
+// the allocator before it scanned a word at a time
+int16_t findFreeDataSpaceBitwise(void)
+{
+    uint16_t size = software_disk_size();
+    for (uint16_t j = FIRST_DATA_BLOCK; j < size; j++)
+    {
+        if (!(bitmap.map[j / 8] & (1 << (j % 8))))
+        {
+            return j;
+        }
+    }
+    return -1;
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fills 'percent' of the data blocks, either as one allocated prefix
+// (what sequential allocation leaves behind) or scattered at random,
+// then recounts the allocator's free blocks from the new bitmap
+void fill_bitmap(int percent, bool scattered)
+{
+    uint32_t dataBlocks = software_disk_size() - FIRST_DATA_BLOCK;
+    uint32_t used = dataBlocks * percent / 100;
+
+    memset(bitmap.map, 0, sizeof(bitmap.map));
+    for (uint32_t j = 0; j < FIRST_DATA_BLOCK; j++)
+    {
+        bitmap.map[j / 8] |= 1 << (j % 8);
+    }
+    for (uint32_t i = 0; i < used; i++)
+    {
+        uint32_t j = FIRST_DATA_BLOCK + i;
+        if (scattered)
+        {
+            do
+            {
+                j = FIRST_DATA_BLOCK + rand() % dataBlocks;
+            } while (bitmap.map[j / 8] & (1 << (j % 8)));
+        }
+        bitmap.map[j / 8] |= 1 << (j % 8);
+    }
+    reset_allocator();
+}
+
+// returns the average ns per call of 'find'
+double time_allocator(int16_t (*find)(void))
+{
+    volatile int16_t sink = 0;
+    double start = now();
+    for (int i = 0; i < ALLOCATIONS; i++)
+    {
+        sink += find();
+    }
+    (void)sink;
+    return (now() - start) * 1e9 / ALLOCATIONS;
+}
+
+int main(int argc, char *argv[])
+{
+    int levels[] = {0, 25, 50, 75, 90, 99, 100};
+
+    srand(4103);
+    printf("%-10s %6s %14s %14s\n", "layout", "fill%", "word ns/alloc", "bit ns/alloc");
+    for (int scattered = 0; scattered <= 1; scattered++)
+    {
+        for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+        {
+            fill_bitmap(levels[i], scattered);
+            if (findFreeDataSpace() != findFreeDataSpaceBitwise())
+            {
+                printf("FAIL.  Allocators disagree at %d%% fill.\n", levels[i]);
+                return 1;
+            }
+            printf("%-10s %6d %14.1f %14.1f\n", scattered ? "scattered" : "prefix",
+                   levels[i], time_allocator(findFreeDataSpace),
+                   time_allocator(findFreeDataSpaceBitwise));
+        }
+    }
+    return 0;
+}
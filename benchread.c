@@ -0,0 +1,101 @@
+//
+// Throughput benchmark for read_file().  Writes one maximum size file
+// and times reads of 1 byte up to the whole 525 KB file from the start
+// of it, checking the bytes that come back, then streams the file in
+// small sequential reads from a cold block cache to show readahead.
+// Run ./formatfs first.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+#define FILE_SIZE (525 * SOFTWARE_DISK_BLOCK_SIZE)
+#define BYTES_PER_SIZE (64 * 1024 * 1024) // read about this much at each size
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t sizes[] = {1, 16, 256, 1024, 1000, 4096, 16384, 65536, 262144, FILE_SIZE};
+    unsigned char *data = malloc(FILE_SIZE);
+    unsigned char *buf = malloc(FILE_SIZE);
+
+    for (uint64_t i = 0; i < FILE_SIZE; i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+    File f = create_file("benchread");
+    if (!f || write_file(f, data, FILE_SIZE) != FILE_SIZE)
+    {
+        fs_print_error();
+        return 1;
+    }
+
+    printf("%10s %10s %12s %10s\n", "read size", "reads", "us/read", "MB/s");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        uint64_t reads = BYTES_PER_SIZE / sizes[i];
+        if (reads > 1000000)
+        {
+            reads = 1000000;
+        }
+        double start = now();
+        for (uint64_t r = 0; r < reads; r++)
+        {
+            seek_file(f, 0);
+            if (read_file(f, buf, sizes[i]) != sizes[i])
+            {
+                fs_print_error();
+                return 1;
+            }
+        }
+        double elapsed = now() - start;
+        if (memcmp(buf, data, sizes[i]) != 0)
+        {
+            printf("FAIL.  Read of %" PRIu64 " bytes doesn't match what was written.\n", sizes[i]);
+            return 1;
+        }
+        printf("%10" PRIu64 " %10" PRIu64 " %12.2f %10.1f\n", sizes[i], reads, elapsed * 1e6 / reads,
+               sizes[i] * reads / elapsed / 1e6);
+    }
+
+    // stream the whole file from a cold cache, the way testfs5b reads
+    uint64_t chunks[] = {100, 1000, 4096};
+    printf("\n%10s %12s %10s %10s %10s\n", "chunk", "ms/file", "MB/s", "misses", "prefetched");
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        SDCacheStats before, after;
+        set_software_disk_cache_size(64); // empties the cache
+        software_disk_cache_stats(&before);
+        seek_file(f, 0);
+        uint64_t total = 0, ret;
+        double start = now();
+        while ((ret = read_file(f, buf + total, chunks[i])) > 0)
+        {
+            total += ret;
+        }
+        double elapsed = now() - start;
+        software_disk_cache_stats(&after);
+        if (total != FILE_SIZE || memcmp(buf, data, FILE_SIZE) != 0)
+        {
+            printf("FAIL.  Streaming in %" PRIu64 " byte reads doesn't match what was written.\n", chunks[i]);
+            return 1;
+        }
+        printf("%10" PRIu64 " %12.3f %10.1f %10" PRIu64 " %10" PRIu64 "\n", chunks[i], elapsed * 1e3,
+               FILE_SIZE / elapsed / 1e6, after.misses - before.misses, after.prefetches - before.prefetches);
+    }
+
+    close_file(f);
+    free(data);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,191 @@
+//
+// Scaling benchmark for the locking in filesystem.c.  Runs the
+// testfs-threads workload (seek, write a short string, seek, read it
+// back) with 1, 2, 4 and 8 threads, each on its own file, and reports
+// the total operations per second, using the error returning fs_*
+// calls.  Independent files should scale until the threads meet on the
+// allocator or the software disk.  Then the same thread counts do
+// random read_file_at() calls through one shared handle on a large
+// file.  Last, each thread rewrites its own file and syncs it with
+// sync_file(); threads syncing at the same time share journal commits,
+// so syncs per second should grow with the threads.
+//
+// RUN formatfs before this benchmark!
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+#define ITERATIONS 20000
+#define MAX_THREADS 8
+#define SHARED_FILE_SIZE (512 * 1024)
+#define SHARED_READ_SIZE 4096
+#define SYNC_ITERATIONS 200 // each one is an fsync or two
+
+File shared;
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// each thread runs this on its own file, returns non-NULL on corruption
+void *worker(void *args)
+{
+    int id = (int)(intptr_t)args;
+    char name[64], buf1[100], buf2[100];
+    File f;
+    uint64_t done;
+
+    sprintf(name, "benchthreads-%d", id);
+    if (fs_create(name, &f) != FS_NONE)
+    {
+        return "create failed";
+    }
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        sprintf(buf1, "Now is the time...or is it? %d %d", id, i);
+        size_t length = strlen(buf1) + 1;
+        if (fs_seek(f, 0) != FS_NONE || fs_write(f, buf1, length, &done) != FS_NONE ||
+            fs_seek(f, 0) != FS_NONE)
+        {
+            fs_close(f);
+            return "write failed";
+        }
+        memset(buf2, 0, sizeof(buf2));
+        if (fs_read(f, buf2, length, &done) != FS_NONE || done != length || strcmp(buf1, buf2))
+        {
+            fs_close(f);
+            return "data corruption";
+        }
+    }
+    fs_close(f);
+    fs_delete(name);
+    return NULL;
+}
+
+// each thread reads random pieces of the shared file through the same
+// handle
+void *shared_reader(void *args)
+{
+    unsigned int seed = (unsigned int)(intptr_t)args;
+    char buf[SHARED_READ_SIZE];
+
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        uint64_t offset = rand_r(&seed) % (SHARED_FILE_SIZE - SHARED_READ_SIZE);
+        if (read_file_at(shared, buf, SHARED_READ_SIZE, offset) != SHARED_READ_SIZE)
+        {
+            return "short read";
+        }
+    }
+    return NULL;
+}
+
+// each thread makes a small write to its own file durable, over and over
+void *syncer(void *args)
+{
+    int id = (int)(intptr_t)args;
+    char name[64];
+    File f;
+
+    sprintf(name, "benchthreads-sync-%d", id);
+    if (fs_create(name, &f) != FS_NONE)
+    {
+        return "create failed";
+    }
+    for (int i = 0; i < SYNC_ITERATIONS; i++)
+    {
+        uint64_t done;
+        if (fs_seek(f, 0) != FS_NONE || fs_write(f, name, sizeof(name), &done) != FS_NONE || !sync_file(f))
+        {
+            fs_close(f);
+            return "sync failed";
+        }
+    }
+    fs_close(f);
+    fs_delete(name);
+    return NULL;
+}
+
+// runs 'work' with 1, 2, 4 and 8 threads, 'calls' filesystem calls per
+// iteration and 'iterations' iterations per thread, and prints the
+// rate for each. Returns false on failure
+bool run_scaling(void *(*work)(void *), int calls, int iterations)
+{
+    int counts[] = {1, 2, 4, 8};
+    double base = 0;
+
+    printf("%8s %12s %14s %8s\n", "threads", "seconds", "ops/s", "speedup");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        pthread_t threads[MAX_THREADS];
+        int n = counts[c];
+        bool failed = false;
+
+        double start = now();
+        for (int i = 0; i < n; i++)
+        {
+            pthread_create(&threads[i], NULL, work, (void *)(intptr_t)i);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            void *result;
+            pthread_join(threads[i], &result);
+            if (result)
+            {
+                printf("FAIL.  Thread %d: %s.\n", i, (char *)result);
+                failed = true;
+            }
+        }
+        double elapsed = now() - start;
+        if (failed)
+        {
+            return false;
+        }
+
+        double rate = (double)calls * iterations * n / elapsed;
+        if (c == 0)
+        {
+            base = rate;
+        }
+        printf("%8d %12.3f %14.0f %8.2f\n", n, elapsed, rate, rate / base);
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    printf("One file per thread, seek/write/seek/read:\n");
+    if (!run_scaling(worker, 4, ITERATIONS))
+    {
+        return 1;
+    }
+
+    char *data = calloc(SHARED_FILE_SIZE, 1);
+    shared = create_file("benchthreads-shared");
+    if (!shared || write_file(shared, data, SHARED_FILE_SIZE) != SHARED_FILE_SIZE)
+    {
+        fs_print_error();
+        return 1;
+    }
+    printf("One shared handle, random %d byte read_file_at:\n", SHARED_READ_SIZE);
+    bool success = run_scaling(shared_reader, 1, ITERATIONS);
+    close_file(shared);
+    delete_file("benchthreads-shared");
+    free(data);
+    if (!success)
+    {
+        return 1;
+    }
+
+    printf("One file per thread, write then sync_file:\n");
+    return run_scaling(syncer, 1, SYNC_ITERATIONS) ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+//
+// Benchmark for small write_file() calls.  Writes a 256 KB file in
+// pieces of 10 bytes up to 4 KB, with per-file write-back buffering
+// on and off, and checks what was written.  Run ./formatfs first.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+#define FILE_SIZE (256 * 1024)
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t chunks[] = {10, 100, 1000, 4096};
+    unsigned char *data = malloc(FILE_SIZE);
+    unsigned char *buf = malloc(FILE_SIZE);
+
+    for (uint64_t i = 0; i < FILE_SIZE; i++)
+    {
+        data[i] = i * 31 % 251;
+    }
+
+    printf("%10s %10s %12s %10s %12s\n", "chunk", "write-back", "us/write", "MB/s", "cache ops");
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        for (int writeBack = 1; writeBack >= 0; writeBack--)
+        {
+            SDCacheStats before, after;
+            File f = create_file("benchwrite");
+            if (!f)
+            {
+                fs_print_error();
+                return 1;
+            }
+            set_file_write_back(f, writeBack);
+            software_disk_cache_stats(&before);
+            uint64_t writes = 0;
+            double start = now();
+            for (uint64_t pos = 0; pos < FILE_SIZE; pos += chunks[i], writes++)
+            {
+                uint64_t len = FILE_SIZE - pos < chunks[i] ? FILE_SIZE - pos : chunks[i];
+                if (write_file(f, data + pos, len) != len)
+                {
+                    fs_print_error();
+                    return 1;
+                }
+            }
+            close_file(f);
+            double elapsed = now() - start;
+            software_disk_cache_stats(&after);
+
+            f = open_file("benchwrite", READ_ONLY);
+            if (!f || read_file(f, buf, FILE_SIZE) != FILE_SIZE || memcmp(buf, data, FILE_SIZE) != 0)
+            {
+                printf("FAIL.  File written in %" PRIu64 " byte pieces doesn't match.\n", chunks[i]);
+                return 1;
+            }
+            close_file(f);
+            delete_file("benchwrite");
+
+            // block cache lookups, runs written around the cache aren't counted
+            printf("%10" PRIu64 " %10s %12.3f %10.1f %12" PRIu64 "\n", chunks[i], writeBack ? "on" : "off",
+                   elapsed * 1e6 / writes, FILE_SIZE / elapsed / 1e6,
+                   (after.hits + after.misses) - (before.hits + before.misses));
+        }
+    }
+    free(data);
+    free(buf);
+    return 0;
+}
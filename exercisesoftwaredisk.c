@@ -7,8 +7,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include "softwaredisk.h"
 
+#define BENCH_OPS 100000
+
 char poetry[]="Do not go gentle into that good night,\n"
   "Old age should burn and rave at close of day;\n"
   "Rage, rage against the dying of the light.\n"
@@ -34,10 +37,103 @@ char poetry[]="Do not go gentle into that good night,\n"
   "Do not go gentle into that good night.\n"
   "Rage, rage against the dying of the light.\n";
 
+// returns the current monotonic time in seconds
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// times BENCH_OPS block operations of each kind against a freshly
+// initialized software disk using 'backend'
+static void bench_backend(SDBackend backend, const char *label) {
+  char buf[SOFTWARE_DISK_BLOCK_SIZE];
+  SDCacheStats before, after;
+  uint16_t size;
+  double start, elapsed;
+  int i;
+
+  start = now();
+  if (! init_software_disk_backend(backend)) {
+    sd_print_error();
+    return;
+  }
+  elapsed = now() - start;
+  printf("%-6s init:          %10.3f ms\n", label, elapsed * 1e3);
+
+  size = software_disk_size();
+  memset(buf, 'A', SOFTWARE_DISK_BLOCK_SIZE);
+  software_disk_cache_stats(&before);
+
+  srand(4103);
+  start = now();
+  for (i = 0; i < BENCH_OPS; i++) {
+    write_sd_block(buf, i % size);
+  }
+  elapsed = now() - start;
+  printf("%-6s seq write:     %10.3f us/block\n", label, elapsed * 1e6 / BENCH_OPS);
+
+  start = now();
+  for (i = 0; i < BENCH_OPS; i++) {
+    read_sd_block(buf, i % size);
+  }
+  elapsed = now() - start;
+  printf("%-6s seq read:      %10.3f us/block\n", label, elapsed * 1e6 / BENCH_OPS);
+
+  start = now();
+  for (i = 0; i < BENCH_OPS; i++) {
+    write_sd_block(buf, rand() % size);
+  }
+  elapsed = now() - start;
+  printf("%-6s random write:  %10.3f us/block\n", label, elapsed * 1e6 / BENCH_OPS);
+
+  start = now();
+  for (i = 0; i < BENCH_OPS; i++) {
+    read_sd_block(buf, rand() % size);
+  }
+  elapsed = now() - start;
+  printf("%-6s random read:   %10.3f us/block\n", label, elapsed * 1e6 / BENCH_OPS);
+
+  start = now();
+  sync_software_disk();
+  elapsed = now() - start;
+  printf("%-6s sync:          %10.3f ms\n", label, elapsed * 1e3);
+
+  software_disk_cache_stats(&after);
+  printf("%-6s cache:         %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " writebacks\n",
+	 label, after.hits - before.hits, after.misses - before.misses,
+	 after.writebacks - before.writebacks);
+}
+
+// compares the software disk backends.  Destroys the contents of the
+// software disk.  A 'cacheblocks' argument resizes the block cache.
+static int benchmark(int argc, char *argv[]) {
+
+  if (argc > 2) {
+    set_software_disk_cache_size(atoi(argv[2]));
+  }
+
+  printf("Benchmarking %d operations per test, block size = %d\n",
+	 BENCH_OPS, SOFTWARE_DISK_BLOCK_SIZE);
+  bench_backend(SD_BACKEND_STDIO, "stdio");
+  bench_backend(SD_BACKEND_PREAD, "pread");
+  bench_backend(SD_BACKEND_MMAP, "mmap");
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   char buf[SOFTWARE_DISK_BLOCK_SIZE];
+  char a[SOFTWARE_DISK_BLOCK_SIZE], b[SOFTWARE_DISK_BLOCK_SIZE], c[SOFTWARE_DISK_BLOCK_SIZE];
+  SDBlockVec vec[3];
   int i,j, ret;
 
+  // "./exercisesoftwaredisk bench [cacheblocks]" compares the
+  // backends instead
+  if (argc > 1 && ! strcmp(argv[1], "bench")) {
+    return benchmark(argc, argv);
+  }
+
   init_software_disk();
   printf("Size of software disk in blocks: %d, block size = %d\n", software_disk_size(), SOFTWARE_DISK_BLOCK_SIZE);
   sd_print_error();
@@ -99,6 +195,40 @@ int main(int argc, char *argv[]) {
     }
     printf("\n");
   }
+
+  printf("Writing A's, B's and C's from separate buffers to blocks # 20, 21 and 40 with one scattered write.\n");
+  memset(a, 'A', SOFTWARE_DISK_BLOCK_SIZE);
+  memset(b, 'B', SOFTWARE_DISK_BLOCK_SIZE);
+  memset(c, 'C', SOFTWARE_DISK_BLOCK_SIZE);
+  vec[0].blocknum = 20; vec[0].buf = a;
+  vec[1].blocknum = 21; vec[1].buf = b;
+  vec[2].blocknum = 40; vec[2].buf = c;
+  ret=write_sd_blockv(vec, 3);
+  printf("Return value was %d.\n", ret);
+  sd_print_error();
+  printf("Reading them back in the opposite order with one scattered read.\n");
+  bzero(a, SOFTWARE_DISK_BLOCK_SIZE);
+  bzero(b, SOFTWARE_DISK_BLOCK_SIZE);
+  bzero(c, SOFTWARE_DISK_BLOCK_SIZE);
+  vec[0].blocknum = 40; vec[0].buf = c;
+  vec[1].blocknum = 21; vec[1].buf = b;
+  vec[2].blocknum = 20; vec[2].buf = a;
+  ret=read_sd_blockv(vec, 3);
+  printf("Return value was %d.\n", ret);
+  sd_print_error();
+  printf("First bytes of blocks # 20, 21 and 40: %c %c %c (should be A B C).\n", a[0], b[0], c[0]);
+
+  printf("Trying a scattered write of D's to blocks # 22 and %d (should fail and write nothing).\n", software_disk_size());
+  memset(a, 'D', SOFTWARE_DISK_BLOCK_SIZE);
+  vec[0].blocknum = 22; vec[0].buf = a;
+  vec[1].blocknum = software_disk_size(); vec[1].buf = a;
+  ret=write_sd_blockv(vec, 2);
+  printf("Return value was %d.\n", ret);
+  sd_print_error();
+  bzero(a, SOFTWARE_DISK_BLOCK_SIZE);
+  ret=read_sd_block(a, 22);
+  printf("First byte of block # 22 in hex: 0x%02x (should be 0x00).\n", a[0]);
+  return 0;
 }
 
   
@@ -5,6 +5,11 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "softwaredisk.h"
 #include "filesystem.h"
 
@@ -14,52 +19,79 @@
 Bitmap:
 1 block = 8,192 blocks
 
+Inode bitmap:
+1 block, 1 bit per inode
+
 Inodes:
-1 block each * 256 files
-= 256 blocks
+32 packed 32 byte inodes per block * 256 files
+= 8 blocks
 
 Dir Entries:
-1 block each * 256 files
-= 256 blocks
+variable length records (8 byte header + name, rounded to 4 bytes) packed
+first-fit from the first of 86 directory blocks, so 256 files with short
+names fill only a handful of blocks. 3 records with 257 character names
+fit in each block, room for all 256 files.
+= 86 blocks
+
+Journal:
+a header block and the images of up to 31 metadata blocks changed by
+one transaction, replayed at mount if a commit made it to disk but its
+checkpoint didn't
+= 32 blocks
 
 Free data:
-13 direct + 512 indirect blocks = 525 blocks each
-Limited to 7679 Free Data block due to bitmap size
+each file is a list of (start, length) extents of data blocks, 6 in the
+inode and 255 more in each overflow block chained off it. A sequential
+file is usually one extent. Files are still capped at 525 blocks each
+(the old 13 direct + 512 indirect limit)
+Limited to 8064 Free Data block due to bitmap size
 
-We use 1 block for the bitmap, 256 for the Inodes, 256 for the Dir Entries that makes 513 blocks. Which leave 8192 - 513 = 7679 blocks for free data.
+We use 1 block for the bitmap, 1 for the inode bitmap, 8 for the Inodes, 86 for the Dir Entries and 32 for the Journal that makes 128 blocks. Which leave 8192 - 128 = 8064 blocks for free data.
 
-So, once the user gets to 7679 blocks, they will not be allowed to make anymore files.
+So, once the user gets to 8064 blocks, they will not be allowed to make anymore files.
 */
 
 #define MAX_NUMBER_OF_FILES 256
-#define NUM_DIRECT_INODE_BLOCKS 13
-#define NUM_INDIRECT_INODE_BLOCKS 512
+#define INODE_NUM_EXTENTS 6   // extents that fit in the inode itself
+#define EXTENTS_PER_BLOCK 255 // extents in an overflow block after its header
 #define BITMAP_BLOCK_SIZE 1 // The bitmap for the entire file system
 #define BITMAP_BLOCKNUM 0
 
-#define INODE_BLOCK_SIZE 1 // 1 for each inode * 256 so 256 total
-#define INODE_FIRST_BLOCKNUM 1
+#define INODE_BITMAP_BLOCKNUM 1
+#define INODES_PER_BLOCK (SOFTWARE_DISK_BLOCK_SIZE / 32) // 32 byte inodes
+#define INODE_NUM_BLOCKS (MAX_NUMBER_OF_FILES / INODES_PER_BLOCK) // 8 blocks
+#define INODE_FIRST_BLOCKNUM 2
 
-#define DIR_ENTRY_BLOCK_SIZE 1 // 1 for each dir entry * 256 so 256 total
-#define DIR_ENTRY_FIRST_BLOCKNUM 257
+#define DIR_ENTRY_NUM_BLOCKS 86 // packed dir entry records, 256 max length names at 3 per block
+#define DIR_ENTRY_FIRST_BLOCKNUM 10
 
-#define DIR_ENTRY_AND_INODE_SIZE 256 // 256 files
+#define JOURNAL_NUM_BLOCKS 32 // header + metadata block images
+#define JOURNAL_FIRST_BLOCKNUM 96
+#define JOURNAL_MAX_BLOCKS (JOURNAL_NUM_BLOCKS - 1) // metadata blocks one transaction can change
+#define JOURNAL_MAGIC 0x4a524e4c // "JRNL", the header of a journal that was ever committed
+#define JOURNAL_NO_BLOCK 0xffff // image of a block that was freed in the same transaction
+#define JOURNAL_HANDLE_BLOCKS 4 // most metadata blocks create or delete changes at once
 
-#define FILE_DATA_BLOCK_SIZE 7679 // Max size left for file data
-#define FILE_DATA_FIRST_BLOCKNUM 513
-#define MAX_DIRECT_BLOCK 13
-#define MAX_INDIRECT_BLOCK 512
+#define FILE_DATA_BLOCK_SIZE 8064 // Max size left for file data
+#define FILE_DATA_FIRST_BLOCKNUM 128
+#define MAX_FILE_BLOCKS 525 // 537,600 bytes
 
 #define FILE_SYSTEM_SIZE 8192
 
-#define MAX_FILE_NAME_SIZE 1021
+#define MAX_FILE_NAME_SIZE 257
+
+#define NAME_INDEX_BUCKETS 512 // power of 2, twice the max number of files
+
+#define READAHEAD_MIN_BLOCKS 4  // first readahead window of a sequential reader
+#define READAHEAD_MAX_BLOCKS 32 // half the default block cache
+
+#define WRITE_BUFFER_BLOCKS 32  // per file write-back buffer, flushed when full
+#define WRITE_BACK_DEFAULT true // files start out buffering small writes
 
-FSError fserror = FS_NONE;
+_Thread_local FSError fserror = FS_NONE; // each thread sees its own calls' errors
 
 typedef enum DataType
 {
-    INODE,
-    DIRECTORY_ENTRY,
     BLOCKS,
 } DataType;
 
@@ -70,12 +102,36 @@ typedef struct FreeBitmap
 } FreeBitmap;
 
 FreeBitmap bitmap;
+FreeBitmap inodeBitmap; // bit n set when inode n is in use
+FreeBitmap pendingFree; // data blocks freed in the running transaction, still set in bitmap until it commits
+
+// allocator state kept next to the in-memory bitmaps, which are the
+// authoritative copy once mounted. The counters let a full disk fail
+// without scanning and the cursor starts the next search where the last
+// allocation left off
+typedef struct AllocatorState
+{
+    uint16_t nextDataBlock;  // next-fit cursor into the data blocks
+    uint16_t freeDataBlocks; // clear bits in bitmap past the metadata
+    uint16_t freeInodes;     // clear bits in inodeBitmap
+    uint16_t delayedBlocks;  // promised to buffered writes, allocated when they're flushed
+    uint16_t pendingFreeBlocks; // set bits in pendingFree
+} AllocatorState;
+
+AllocatorState allocator;
+
+typedef struct Extent // 4 bytes
+{
+    uint16_t start;  // first data block of the run
+    uint16_t length; // number of blocks in the run
+} Extent;
 
 typedef struct Inode // 32 bytes
 {
-    int32_t size;                                 // size of the file | 4 bytes
-    uint16_t blocks[NUM_DIRECT_INODE_BLOCKS + 1]; // 28 bytes | all of the pointers to direct
-                                                  // blocks and a pointer to another array of indirect blocks
+    int32_t size;                      // size of the file | 4 bytes
+    uint16_t numExtents;               // 2 bytes | extents in the inode and its overflow blocks
+    uint16_t overflowBlock;            // 2 bytes | first block of further extents, 0 if none
+    Extent extents[INODE_NUM_EXTENTS]; // 24 bytes | the first runs of the file's blocks, in order
 } Inode;
 
 typedef struct InodeBlock
@@ -84,28 +140,141 @@ typedef struct InodeBlock
 } InodeBlock;
 
 typedef struct DirEntry
-{                           // 1024 total
-    char name[MAX_FILE_NAME_SIZE];             // min 257 actually 1021
-    bool isFileOpen;        // 1 byte
-    uint16_t inodeBlockNum; // 2 bytes
+{                           // 8 byte header, the name follows
+    uint16_t inodeNum;      // 2 bytes | slot in the packed inode table
+    uint16_t recordLength;  // 2 bytes | offset to the next record, the last one runs to the end of the block
+    uint16_t nameLength;    // 2 bytes | not counting the '\0', 0 marks an unused record
+    bool isFileOpen;        // 1 byte | no longer used, open files are tracked in openFiles
+    uint8_t reserved;       // 1 byte
+    char name[];            // nameLength bytes + '\0'
 } DirEntry;
 
-typedef struct IndirectBlock
+// bytes used by a record for a name of nameLength characters
+#define DIR_RECORD_SIZE(nameLength) ((sizeof(DirEntry) + (nameLength) + 1 + 3) & ~(size_t)3)
+
+typedef struct ExtentBlock
+{
+    uint16_t next;       // next overflow block, 0 if this is the last
+    uint16_t numExtents; // extents used in this block
+    Extent extents[EXTENTS_PER_BLOCK];
+} ExtentBlock;
+
+// the journal's first block, naming the home of each image after it
+typedef struct JournalHeader
+{
+    uint32_t magic;                         // JOURNAL_MAGIC
+    uint32_t sequence;                      // counts commits
+    uint32_t checksum;                      // of everything below and the images, so a torn commit isn't replayed
+    uint16_t numBlocks;                     // images following the header
+    uint16_t blocknums[JOURNAL_MAX_BLOCKS]; // where each image belongs
+} JournalHeader;
+
+// the running transaction, every metadata block changed since the last
+// commit. Metadata is changed here and only reaches its home block
+// through the block cache once the transaction is committed to the
+// journal, so the disk never holds half an update
+typedef struct Transaction
 {
-    uint16_t blocks[NUM_INDIRECT_INODE_BLOCKS];
-} IndirectBlock;
+    unsigned char images[JOURNAL_MAX_BLOCKS][SOFTWARE_DISK_BLOCK_SIZE]; // first, so inode blocks are aligned
+    uint16_t numBlocks;                     // images in use, forgotten ones too
+    uint16_t reserved;                      // blocks promised to handles still running
+    uint16_t blocknums[JOURNAL_MAX_BLOCKS]; // home of each image, JOURNAL_NO_BLOCK if forgotten
+} Transaction;
+
+// an open file's extents decoded once, so mapping an offset is a binary
+// search in memory instead of a walk through the overflow blocks. Extents
+// past the inode's own are only written back to their overflow blocks on
+// close
+typedef struct ExtentMap
+{
+    Extent *extents;           // every extent in file order, the inode's first
+    uint32_t *ends;            // file block just past each extent
+    uint16_t count;
+    uint16_t capacity;
+    uint16_t *overflowBlocks;  // the overflow block chain in order
+    uint16_t numOverflowBlocks;
+    bool dirty;                // overflow extents changed since loaded
+} ExtentMap;
+
+// what every handle open on the same file shares, from the first open
+// until the last close
+typedef struct OpenInode
+{
+    uint16_t inodeNum;
+    uint16_t readers;            // READ_ONLY handles open
+    bool writer;                 // the one READ_WRITE handle is open
+    Inode inode;                 // written back on sync or the writer's close
+    struct ExtentMap *extentMap; // decoded extents, loaded at open
+    unsigned char *writeBuffer;  // WRITE_BUFFER_BLOCKS blocks, NULL until first used
+    uint32_t bufferStart;        // file block in the first buffer slot
+    uint16_t bufferBlocks;       // buffer slots in use, all of them dirty
+    uint16_t delayedBlocks;      // buffer blocks promised space but not allocated yet
+    uint16_t promisedBlocks;     // space promised for them, with the overflow blocks their extents could need
+    bool inodeDirty;             // size or extents changed since the inode was written
+    bool bitmapDirty;            // blocks allocated since the bitmap was written
+} OpenInode;
 
 struct FileInternals
 {
     uint32_t filePosition;    // 4 bytes
     FileMode fileMode;        // 4 byte
-    DirEntry *directoryEntry; // 300 bytes
-    Inode *inode;
+    bool isOpen;              // cleared by close_file
+    OpenInode *node;          // state shared with the file's other handles
+    pthread_mutex_t lock;     // this handle's position and readahead state
+    uint32_t nextReadPosition; // where the next read starts if the reader is sequential
+    uint16_t readaheadBlocks;  // readahead window, doubles while reads stay sequential
+    uint32_t readaheadEnd;     // file blocks before this one have been prefetched
+    bool writeBack;            // hold small writes until close, sync_file or a full buffer, guarded by the inode lock
 };
 // file type used by user code
 typedef struct FileInternals *File;
 
-struct FileInternals files[MAX_NUMBER_OF_FILES]; // array of all the fileinternal pointers
+// open file table, indexed by inode number. An entry exists while any
+// handle has the file open, so opening doesn't write anything to disk
+OpenInode *openFiles[MAX_NUMBER_OF_FILES];
+
+typedef struct NameIndexEntry
+{
+    uint32_t hash;
+    uint16_t dirEntryBlockNum;
+    uint16_t dirEntryOffset;
+    struct NameIndexEntry *next; // next entry in the same bucket
+    char name[];
+} NameIndexEntry;
+
+// in-memory name -> dir entry record index, built at mount and kept
+// current by create_file and delete_file so lookups don't touch the disk
+NameIndexEntry *nameIndex[NAME_INDEX_BUCKETS];
+
+Transaction transaction;
+uint8_t journalSlots[FILE_SYSTEM_SIZE]; // 1 + the image of each block in the transaction, 0 if it has none
+uint32_t journalSequence;               // of the last commit
+uint64_t syncRequests;                  // journal_sync() calls so far, guarded by transactionLock
+uint64_t syncedRequests;                // how many of them a finished sync covered, guarded by journalLock
+
+atomic_bool mounted = false; // set once the mount is complete, read without mountLock
+
+// LOCKING:
+// allocLock guards the bitmaps, the allocator state and writing the
+// bitmap blocks, held for one allocation or release at a time, or for
+// every block one write or buffer flush takes.
+// dirLock guards the dir entry blocks and the name index, shared by
+// lookups and exclusive for create and delete. inodeLocks[n] guards
+// openFiles[n], the file's inode, extent map and write buffer, so
+// threads working on different files only meet on the allocator.
+// Reads share it, anything that changes the file takes it exclusively.
+// A handle's own lock guards its position. journalLock is shared by
+// every journal handle, the span of one metadata update, and taken
+// exclusively to commit, so a commit sees whole updates only.
+// transactionLock guards the running transaction's block list. Locks
+// are taken in the order handle lock, dirLock, inodeLocks, journalLock,
+// allocLock, transactionLock
+pthread_mutex_t mountLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t journalLock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t transactionLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t dirLock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t inodeLocks[MAX_NUMBER_OF_FILES] = {[0 ... MAX_NUMBER_OF_FILES - 1] = PTHREAD_RWLOCK_INITIALIZER};
 
 // HELPER FUNCTIONS:
 
@@ -113,10 +282,6 @@ size_t get_data_size(DataType type)
 {
     switch (type)
     {
-    case INODE:
-        return sizeof(Inode);
-    case DIRECTORY_ENTRY:
-        return sizeof(DirEntry);
     case BLOCKS:
         return SOFTWARE_DISK_BLOCK_SIZE;
     default:
@@ -124,62 +289,6 @@ size_t get_data_size(DataType type)
     }
 }
 
-// READS DATA FROM BLOCKNUM AT POSITION TILL THE END OF THE FILE
-// Correctly null terminates the end of the data read.
-unsigned char *read_data_from_disk(uint16_t blocknum, uint32_t position)
-{
-    if (position >= SOFTWARE_DISK_BLOCK_SIZE || position < 0)
-    {
-        return NULL;
-    }
-    unsigned char buf[SOFTWARE_DISK_BLOCK_SIZE] = {'\0'};
-
-    if (!read_sd_block(buf, blocknum))
-    {
-        fserror = FS_FILE_NOT_FOUND;
-        return NULL;
-    }
-    unsigned char *data = malloc(sizeof(char) * ((SOFTWARE_DISK_BLOCK_SIZE - position) + 1));
-    if (!data)
-    {
-        return NULL;
-    }
-    memcpy(data, buf + position, sizeof(char) * (SOFTWARE_DISK_BLOCK_SIZE - position));
-    data[((SOFTWARE_DISK_BLOCK_SIZE - position) + 1)] = '\0';
-    fserror = FS_NONE;
-    return data;
-}
-
-// reads type DataType at blocknum with optionl position in file
-void *read_from_disk(DataType type, uint16_t blocknum)
-{   
-   // printf("READ FROM DISK\n");
-    char buf[SOFTWARE_DISK_BLOCK_SIZE] = {'\0'};
-
-    if (!read_sd_block(buf, blocknum))
-    {
-        fserror = FS_FILE_NOT_FOUND;
-        return NULL;
-    }
-
-    size_t size = get_data_size(type);
-    if (size == 0)
-    { // Unsupported type
-        return NULL;
-    }
-
-    void *object = malloc(size);
-    if (!object)
-    {
-        return NULL;
-    }
-    
-    memcpy(object, buf, size);
-   // printf("END READ FROM DISK\n");
-    fserror = FS_NONE;
-    return object;
-}
-
 bool write_to_disk(void *data, DataType type, uint16_t blocknum)
 {
     char buf[SOFTWARE_DISK_BLOCK_SIZE] = {'\0'};
@@ -192,20 +301,7 @@ bool write_to_disk(void *data, DataType type, uint16_t blocknum)
 
     memcpy(buf, data, size);
 
-    bool result = write_sd_block(buf, blocknum);
-
-    // testing
-    if (type == DIRECTORY_ENTRY) {
-        // read_sd_block(buf, blocknum);
-
-        // buf[SOFTWARE_DISK_BLOCK_SIZE-1] = '\0';
-
-        DirEntry *dirEntry = (DirEntry *) read_from_disk(DIRECTORY_ENTRY, blocknum);
-
-        // printf("testing writing %s\n", dirEntry->name);
-    }
-
-    return result;
+    return write_sd_block(buf, blocknum);
 }
 
 bool clear_block(uint16_t blocknum)
@@ -216,493 +312,2021 @@ bool clear_block(uint16_t blocknum)
     return write_to_disk(&clear, BLOCKS, blocknum);
 }
 
-char *getFullFileName(char *name, size_t length)
-{
-    if (length > MAX_FILE_NAME_SIZE) {
-        return NULL;
-    }
-
-    // Allocate exactly 1021 bytes
-    char *padded_name = (char *)malloc(MAX_FILE_NAME_SIZE);
-    if (!padded_name)
-    {
-        return NULL;
-    }
-
-    strncpy(padded_name, name, length);
-
-    // Fill the remaining bytes with '\0', but apparently strncpy does this already
-    // memset(padded_name + length, '\0', MAX_FILE_NAME_SIZE - length);
-
-    padded_name[MAX_FILE_NAME_SIZE - 1] = '\0';
-
-    return padded_name;
-}
-
 // BITMAP HELPERS:
 // set jth bit in a bitmap composed of 8-bit integers
-void set_bit(uint16_t j)
+void set_bit(FreeBitmap *map, uint16_t j)
 {
-    bitmap.map[j / 8] |= (1 << (j % 8));
+    map->map[j / 8] |= (1 << (j % 8));
 }
 
 // clear jth bit in a bitmap composed of 8-bit integers
-void clear_bit(uint16_t j)
+void clear_bit(FreeBitmap *map, uint16_t j)
 {
-    bitmap.map[j / 8] &= ~(1 << (j % 8));
+    map->map[j / 8] &= ~(1 << (j % 8));
 }
 
 // returns true if jth bit is set in a bitap of 8-bit integers,
 // otherwise false
-bool is_bit_set(uint16_t j)
+bool is_bit_set(FreeBitmap *map, uint16_t j)
 {
-    return bitmap.map[j / 8] & (1 << (j % 8));
+    return map->map[j / 8] & (1 << (j % 8));
 }
 
-// try to find an existing directory entry, if u cant 
-int16_t findDirEntry(char *name)
-{   
-//    printf("FIND DIR ENTRY\n");
-    // char buf[SOFTWARE_DISK_BLOCK_SIZE];
-    read_sd_block(bitmap.map, 0);
-    for (uint16_t i = DIR_ENTRY_FIRST_BLOCKNUM; i < DIR_ENTRY_FIRST_BLOCKNUM + MAX_NUMBER_OF_FILES; i++)
-    {   
-        // printf("Checking for dir entry at block %d\n", i);
-        // if (i == 257) {
-        //     DirEntry *dirEntry = (DirEntry *)read_from_disk(DIRECTORY_ENTRY, i);
-        //     if (dirEntry == NULL) {
-        //         fserror = FS_IO_ERROR;
-        //         return -1;
-        //     }
-
-        //    printf("ABout to string compare\n");
-        //    printf("strlen of name passed in: %lu\n", strlen(name));
-        //    printf("strlen of DIR ENTRY name in: %lu\n", strlen(dirEntry->name));
-        //     if (strcmp(dirEntry->name, name) == 0) // its a match!
-        //     {
-        //        printf("FOUND A MATCH\n");
-        //         return i + DIR_ENTRY_FIRST_BLOCKNUM;
-        //     }
-        //    printf("Not a match");
-        // }
-        if (is_bit_set(i))
-        {
-            DirEntry *dirEntry = (DirEntry *)read_from_disk(DIRECTORY_ENTRY, i);
-            if (dirEntry == NULL) {
-                fserror = FS_IO_ERROR;
-                return -1;
-            }
+// returns bits 64 * w to 64 * w + 63 of a bitmap, bit j of the map
+// landing in bit j % 64 of the word
+uint64_t load_bitmap_word(FreeBitmap *map, uint32_t w)
+{
+    uint64_t word;
+    memcpy(&word, map->map + w * 8, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
 
-        //    printf("ABout to string compare\n");
-        //    printf("strlen of name passed in: %lu\n", strlen(name));
-        //    printf("strlen of DIR ENTRY name in: %lu\n", strlen(dirEntry->name));
-            if (strcmp(dirEntry->name, name) == 0) // its a match!
-            {
-            //    printf("FOUND A MATCH\n");
-                return i + DIR_ENTRY_FIRST_BLOCKNUM;
-            }
-        //    printf("Not a match");
+// skips words w .. lastWord of a bitmap that are completely allocated
+// (all ones) 128 or 256 bits at a time when SSE2/AVX2 is available.
+// Returns the first word that may have a clear bit
+uint32_t skip_full_bitmap_words(FreeBitmap *map, uint32_t w, uint32_t lastWord)
+{
+#if defined(__AVX2__)
+    const __m256i ones256 = _mm256_set1_epi8((char)0xFF);
+    while (w + 3 <= lastWord)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(map->map + w * 8));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, ones256)) != 0xFFFFFFFFu)
+        {
+            break;
         }
+        w += 4;
     }
-//    printf("END FIND DIR ENTRY\n");
-    return -1;
+#endif
+#if defined(__SSE2__)
+    const __m128i ones128 = _mm_set1_epi8((char)0xFF);
+    while (w + 1 <= lastWord)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(map->map + w * 8));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, ones128)) != 0xFFFF)
+        {
+            break;
+        }
+        w += 2;
+    }
+#endif
+    (void)map;
+    (void)lastWord;
+    return w;
 }
 
-// finds free space in the bitmap
-int16_t findFreeDataSpace(void)
+// returns the first clear bit j with from <= j < to, scanning 64 bits
+// at a time with ctz, or -1 if every bit in the range is set
+int32_t find_clear_bit(FreeBitmap *map, uint32_t from, uint32_t to)
 {
-    for (uint16_t j = FILE_DATA_FIRST_BLOCKNUM; j < FILE_SYSTEM_SIZE; j++)
+    if (from >= to)
+    {
+        return -1;
+    }
+    uint32_t w = from / 64;
+    uint32_t lastWord = (to - 1) / 64;
+    // bits below from count as set
+    uint64_t word = load_bitmap_word(map, w) | ((UINT64_C(1) << (from % 64)) - 1);
+    while (word == UINT64_MAX)
     {
-        if (!is_bit_set(j))
+        if (++w > lastWord)
+        {
+            return -1;
+        }
+        w = skip_full_bitmap_words(map, w, lastWord);
+        if (w > lastWord)
         {
-            return j;
+            return -1;
         }
+        word = load_bitmap_word(map, w);
     }
-    return -1;
+    uint32_t j = w * 64 + __builtin_ctzll(~word);
+    return j < to ? (int32_t)j : -1;
 }
 
-// finds free space in the bitmap
-int16_t findFreeInodeSpace(void)
+// returns the first set bit j with from <= j < to, or to if the whole
+// range is clear. Used to measure a free run starting at from
+uint32_t find_set_bit(FreeBitmap *map, uint32_t from, uint32_t to)
 {
-    for (uint16_t j = INODE_FIRST_BLOCKNUM; j < INODE_FIRST_BLOCKNUM + MAX_NUMBER_OF_FILES; j++)
+    uint32_t w = from / 64;
+    // bits below from count as clear
+    uint64_t word = load_bitmap_word(map, w) & ~((UINT64_C(1) << (from % 64)) - 1);
+    while (word == 0)
     {
-        if (!is_bit_set(j))
+        if (++w * 64 >= to)
         {
-            return j;
+            return to;
         }
+        word = load_bitmap_word(map, w);
     }
-    return -1;
+    uint32_t j = w * 64 + __builtin_ctzll(word);
+    return j < to ? j : to;
 }
 
-int16_t findFreeDirEntrySpace(void)
+// returns the number of set bits j with from <= j < to
+uint32_t count_set_bits(FreeBitmap *map, uint32_t from, uint32_t to)
 {
-    for (uint16_t j = DIR_ENTRY_FIRST_BLOCKNUM; j < DIR_ENTRY_FIRST_BLOCKNUM + MAX_NUMBER_OF_FILES; j++)
+    uint32_t count = 0;
+    for (uint32_t w = from / 64; w * 64 < to; w++)
     {
-        if (!is_bit_set(j))
+        uint64_t word = load_bitmap_word(map, w);
+        if (w == from / 64)
+        {
+            word &= ~((UINT64_C(1) << (from % 64)) - 1);
+        }
+        if ((w + 1) * 64 > to)
         {
-            return j;
+            word &= (UINT64_C(1) << (to % 64)) - 1;
         }
+        count += __builtin_popcountll(word);
     }
-    return -1;
+    return count;
 }
 
-// MAIN FUNCTIONS:
+// JOURNAL HELPERS:
+// Metadata updates gather in the running transaction until it fills
+// up, a file is synced or the program exits, then all of them are
+// committed with one sequential journal write. The journal holds only
+// the last commit, so before it is reused everything checkpointed
+// since has to reach the disk, which is also what makes file data
+// written before a commit safe ahead of the metadata that points to it
 
-File create_file(char *name)
-{   
-    // printf("CREATE FILE\n");
-    if (name[0] == '\0' || strlen(name) > 257)
+// continues an FNV-1a hash over length more bytes
+uint32_t hash_bytes(uint32_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++)
     {
-        fserror = FS_ILLEGAL_FILENAME;
-       // printf("Illegal filename");
-        return NULL;
+        hash ^= bytes[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    int32_t index = -1; // tracks the index
+uint32_t journal_checksum(JournalHeader *header, void *images)
+{
+    JournalHeader copy = *header;
+    copy.checksum = 0;
+    uint32_t hash = hash_bytes(2166136261u, &copy, sizeof(copy));
+    return hash_bytes(hash, images, (size_t)header->numBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+}
 
-    // char buf[SOFTWARE_DISK_BLOCK_SIZE];
-    bool success = read_sd_block(bitmap.map, 0);
-    if (!success) {
-        // printf("CREATE FILE READ BITMAP BLOCK FAILED\n");
-        fserror = FS_IO_ERROR;
-        return NULL;
+// makes the data blocks freed by the transaction that just committed
+// allocatable, called by the commit once the transaction is durable
+void release_pending_blocks(void)
+{
+    pthread_mutex_lock(&allocLock);
+    for (uint32_t j = find_set_bit(&pendingFree, FILE_DATA_FIRST_BLOCKNUM, FILE_SYSTEM_SIZE); j < FILE_SYSTEM_SIZE;
+         j = find_set_bit(&pendingFree, j + 1, FILE_SYSTEM_SIZE))
+    {
+        clear_bit(&pendingFree, j);
+        clear_bit(&bitmap, j);
+        allocator.freeDataBlocks++;
     }
-    else {
+    allocator.pendingFreeBlocks = 0;
+    pthread_mutex_unlock(&allocLock);
+}
+
+// writes the running transaction to the journal and then checkpoints it
+// to the block cache, called with journalLock held for writing. If the
+// journal can't be written the images are still checkpointed, the file
+// system stays right but isn't crash safe for this transaction
+bool journal_commit_locked(void)
+{
+    if (transaction.numBlocks == 0)
+    {
+        return true;
     }
-    bool found = true;
-    // reading dir entries to check for duplicate names
-    for (uint16_t i = DIR_ENTRY_FIRST_BLOCKNUM; i < DIR_ENTRY_FIRST_BLOCKNUM + MAX_NUMBER_OF_FILES; i++)
+
+    // forgotten images are left out
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    for (uint16_t i = 0; i < transaction.numBlocks; i++)
     {
-        if (is_bit_set(i))
+        if (transaction.blocknums[i] == JOURNAL_NO_BLOCK)
         {
-            // read_sd_block(buf, i);
-
-            // We want the file to not exist yet with that name
-            if (findDirEntry(name) != -1)
-            {
-                fserror = FS_FILE_ALREADY_EXISTS;
-                return NULL;
-            }
+            continue;
         }
-        else if (found)
+        if (i != header.numBlocks)
         {
-            index = i;     // gets earliest open spot
-            found = false; // prev
+            memcpy(transaction.images[header.numBlocks], transaction.images[i], SOFTWARE_DISK_BLOCK_SIZE);
         }
+        journalSlots[transaction.blocknums[i]] = 0;
+        header.blocknums[header.numBlocks++] = transaction.blocknums[i];
     }
-
-    if (index == -1)
+    header.magic = JOURNAL_MAGIC;
+    header.sequence = journalSequence + 1;
+    header.checksum = journal_checksum(&header, transaction.images);
+
+    // the last checkpoint and any data blocks the new metadata points to
+    // go to disk first, then the images and their header in one pass
+    unsigned char block[SOFTWARE_DISK_BLOCK_SIZE] = {0};
+    memcpy(block, &header, sizeof(header));
+    bool logged = header.numBlocks == 0 ? sync_software_disk() :
+                  (sync_software_disk() &&
+                   write_sd_blocks(transaction.images, JOURNAL_FIRST_BLOCKNUM + 1, header.numBlocks) &&
+                   write_sd_block(block, JOURNAL_FIRST_BLOCKNUM) &&
+                   sync_software_disk());
+    if (logged && header.numBlocks)
     {
-        fserror = FS_OUT_OF_SPACE;
-        // printf("CreateFile directory entry couldnt find a spot\n");
-        return NULL;
+        journalSequence = header.sequence;
     }
-
-    File file = malloc(sizeof(struct FileInternals));
-
-    Inode *newInode = malloc(sizeof(Inode));
-    newInode->size = 0;
-    memset(newInode->blocks, '\0', NUM_DIRECT_INODE_BLOCKS + 1);
-    file->inode = newInode;
-
-    // find the first data block that is available
-    int16_t blocknum = findFreeDataSpace();
-    if (blocknum == -1)
+    if (logged)
     {
-        fserror = FS_OUT_OF_SPACE;
-        //  printf("CreateFile INODE couldnt find a spot\n");
-        return NULL;
+        release_pending_blocks();
     }
-    // printf("Checked for free space for INODE\n");
-    file->inode->blocks[0] = (uint16_t)blocknum;
-    clear_block((uint16_t)blocknum);
-    set_bit((uint16_t)blocknum); // setting bitmap for when we allocate a block to newly opened file data
 
-    // find a free space for the inode and dir entry
-    int16_t inodeBlockNum = findFreeInodeSpace();
-    if (inodeBlockNum == -1)
+    // the home blocks can be written back whenever the cache likes now
+    bool checkpointed = true;
+    for (uint16_t i = 0; i < header.numBlocks; i++)
     {
-        fserror = FS_OUT_OF_SPACE;
-        // printf("CreateFile inodeblocknum couldnt find a spot\n");
-        return NULL;
+        checkpointed = write_sd_block(transaction.images[i], header.blocknums[i]) && checkpointed;
     }
-    set_bit((uint16_t)inodeBlockNum); // set the new Inode in bitmapp
-
-    // printf("INODE BLOCK: %d\n", inodeBlockNum);
-
-
-
-    // write the inode and dir entry
-    if (!write_to_disk(newInode, INODE, (uint16_t)inodeBlockNum))
+    transaction.numBlocks = 0;
+    if (!logged || !checkpointed)
     {
         fserror = FS_IO_ERROR;
-        return NULL;
+        return false;
     }
+    return true;
+}
+
+bool journal_commit(void)
+{
+    pthread_rwlock_wrlock(&journalLock);
+    bool committed = journal_commit_locked();
+    pthread_rwlock_unlock(&journalLock);
+    return committed;
+}
 
-    DirEntry *newDirEntry = malloc(sizeof(DirEntry));
-    newDirEntry->inodeBlockNum = inodeBlockNum;
-    char *fileName = getFullFileName(name, strlen(name));
-    strcpy(newDirEntry->name, fileName);
-    newDirEntry->isFileOpen = false;
-    file->directoryEntry = newDirEntry;
-    // printf("Creating a file with the name: %s\n", file->directoryEntry->name);
+// makes everything written to the file system before the call durable,
+// committing the running transaction or, if it's empty, just syncing
+// the disk for the data. Callers that arrive while another thread is
+// syncing wait for it and then share the next sync, which covers all
+// of them, so a burst of syncs costs two commits at most
+bool journal_sync(void)
+{
+    pthread_mutex_lock(&transactionLock);
+    uint64_t ticket = ++syncRequests;
+    pthread_mutex_unlock(&transactionLock);
 
-    uint16_t dirEntryBlockNum = (uint16_t)inodeBlockNum + MAX_NUMBER_OF_FILES;
-    if (!write_to_disk(newDirEntry, DIRECTORY_ENTRY, dirEntryBlockNum))
+    pthread_rwlock_wrlock(&journalLock);
+    bool synced = true;
+    if (syncedRequests < ticket)
     {
-        fserror = FS_IO_ERROR;
-        return NULL;
+        pthread_mutex_lock(&transactionLock);
+        uint64_t covered = syncRequests;
+        pthread_mutex_unlock(&transactionLock);
+        synced = transaction.numBlocks ? journal_commit_locked() : sync_software_disk();
+        if (synced)
+        {
+            syncedRequests = covered;
+        }
+        else
+        {
+            fserror = FS_IO_ERROR;
+        }
     }
-    set_bit(dirEntryBlockNum); // marks the directory entry as taken
-    // printf("DIRENTRY BLOCK: %d\n", dirEntryBlockNum);
+    pthread_rwlock_unlock(&journalLock);
+    return synced;
+}
 
-    file->filePosition = (uint32_t)0;
+// writes out what open files are still buffering and commits whatever
+// is left when the program exits, before the block cache writes itself
+// back
+void journal_exit(void)
+{
+    sync_all_files();
+    journal_commit();
+}
 
-    // updates bitmap
-    if (!write_sd_block(bitmap.map, 0))
+// replays the last commit onto its home blocks, called at mount. A
+// header that doesn't match its images is from a commit that was torn
+// part way, and the commit before it is already home
+bool journal_recover(void)
+{
+    unsigned char block[SOFTWARE_DISK_BLOCK_SIZE];
+    JournalHeader header;
+    if (!read_sd_block(block, JOURNAL_FIRST_BLOCKNUM))
     {
-        fserror = FS_IO_ERROR;
         return false;
     }
-
-    // printf("END CREATE\n");
-    fserror = FS_NONE;
-    return open_file(name, READ_WRITE);
+    memcpy(&header, block, sizeof(header));
+    if (header.magic != JOURNAL_MAGIC || header.numBlocks > JOURNAL_MAX_BLOCKS)
+    {
+        return true; // nothing was ever committed
+    }
+    journalSequence = header.sequence;
+    if (!read_sd_blocks(transaction.images, JOURNAL_FIRST_BLOCKNUM + 1, header.numBlocks))
+    {
+        return false;
+    }
+    if (journal_checksum(&header, transaction.images) != header.checksum)
+    {
+        return true;
+    }
+    for (uint16_t i = 0; i < header.numBlocks; i++)
+    {
+        if (!write_sd_block(transaction.images[i], header.blocknums[i]))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-File open_file(char *name, FileMode mode)
+// starts a handle for an update that changes at most blocks metadata
+// blocks, committing first if the running transaction has no room for
+// them. Every metadata access is made inside a handle. The caller
+// already holds the directory and inode locks the update needs, and
+// nothing but allocLock is taken inside, so a commit waiting for the
+// handles to finish never waits on anything else
+void journal_start(uint16_t blocks)
 {
-    // printf("OPENING\n");
-    File file = malloc(sizeof(struct FileInternals));
-    int16_t index = findDirEntry(name);
-    if (index == -1)
+    for (;;)
     {
-        fserror = FS_FILE_NOT_FOUND;
-        return NULL;
+        pthread_rwlock_rdlock(&journalLock);
+        pthread_mutex_lock(&transactionLock);
+        bool room = blocks == 0 || transaction.numBlocks + transaction.reserved + blocks <= JOURNAL_MAX_BLOCKS;
+        if (room)
+        {
+            transaction.reserved += blocks;
+        }
+        pthread_mutex_unlock(&transactionLock);
+        if (room)
+        {
+            return;
+        }
+        pthread_rwlock_unlock(&journalLock);
+        journal_commit();
     }
-    // printf("File FOund\n");
+}
 
-    file->filePosition = 0;
-    file->fileMode = mode;
+void journal_stop(uint16_t blocks)
+{
+    pthread_mutex_lock(&transactionLock);
+    transaction.reserved -= blocks;
+    pthread_mutex_unlock(&transactionLock);
+    pthread_rwlock_unlock(&journalLock);
+}
 
-    DirEntry *dirEntry = malloc(sizeof(DirEntry));
-    void *data = read_from_disk(DIRECTORY_ENTRY, (uint16_t)index);
-    if (data == NULL)
-    {
-        fserror = FS_IO_ERROR;
-        return NULL;
-    }
-    else
+// returns the running transaction's image of metadata block blocknum to
+// change in place, copying the block in the first time. Called inside a
+// handle that reserved room for it
+unsigned char *journal_get_block(uint16_t blocknum)
+{
+    pthread_mutex_lock(&transactionLock);
+    uint16_t slot = journalSlots[blocknum];
+    if (slot == 0 && transaction.numBlocks < JOURNAL_MAX_BLOCKS &&
+        read_sd_block(transaction.images[transaction.numBlocks], blocknum))
     {
-        dirEntry = (DirEntry *)data;
+        transaction.blocknums[transaction.numBlocks] = blocknum;
+        slot = ++transaction.numBlocks;
+        journalSlots[blocknum] = slot;
     }
-    if (dirEntry->isFileOpen)
+    pthread_mutex_unlock(&transactionLock);
+    if (slot == 0)
     {
-        fserror = FS_FILE_OPEN;
+        fserror = FS_IO_ERROR;
         return NULL;
     }
-    char *fileName = getFullFileName(name, strlen(name));
-    strcpy(dirEntry->name, fileName);
-    dirEntry->isFileOpen = true;
-    file->directoryEntry = dirEntry;
-    // printf("OPEN FILE name %s\n", file->directoryEntry->name);
+    return transaction.images[slot - 1];
+}
 
-    Inode *inode = malloc(sizeof(Inode));
-    data = read_from_disk(INODE, (uint16_t)index);
-    if (data == NULL)
+// returns metadata block blocknum to read, the running transaction's
+// image if it has one and otherwise the block pinned in the cache.
+// Called inside a handle, released with journal_unpin_block()
+unsigned char *journal_pin_block(uint16_t blocknum)
+{
+    pthread_mutex_lock(&transactionLock);
+    uint16_t slot = journalSlots[blocknum];
+    pthread_mutex_unlock(&transactionLock);
+    unsigned char *block = slot ? transaction.images[slot - 1] : pin_sd_block(blocknum);
+    if (block == NULL)
     {
         fserror = FS_IO_ERROR;
-        return NULL;
     }
-    else
+    return block;
+}
+
+void journal_unpin_block(uint16_t blocknum, unsigned char *block)
+{
+    unsigned char *images = (unsigned char *)transaction.images;
+    if (block < images || block >= images + sizeof(transaction.images))
     {
-        inode = (Inode *)data;
+        unpin_sd_block(blocknum);
     }
+}
 
-    file->inode = inode;
+// drops the image of a metadata block that is being freed, so replaying
+// the transaction can't overwrite whatever the block is used for next
+void journal_forget(uint16_t blocknum)
+{
+    pthread_mutex_lock(&transactionLock);
+    if (journalSlots[blocknum])
+    {
+        transaction.blocknums[journalSlots[blocknum] - 1] = JOURNAL_NO_BLOCK;
+        journalSlots[blocknum] = 0;
+    }
+    pthread_mutex_unlock(&transactionLock);
+}
 
-    // printf("END OPEN\n");
-    fserror = FS_NONE;
-    return file;
+// ALLOCATOR HELPERS:
+// recounts the free blocks and inodes from the bitmaps and rewinds the
+// cursor, called at mount
+void reset_allocator(void)
+{
+    allocator.nextDataBlock = FILE_DATA_FIRST_BLOCKNUM;
+    allocator.freeDataBlocks = FILE_DATA_BLOCK_SIZE - count_set_bits(&bitmap, FILE_DATA_FIRST_BLOCKNUM, FILE_SYSTEM_SIZE);
+    allocator.freeInodes = MAX_NUMBER_OF_FILES - count_set_bits(&inodeBitmap, 0, MAX_NUMBER_OF_FILES);
+    allocator.delayedBlocks = 0;
+    allocator.pendingFreeBlocks = 0;
+    memset(pendingFree.map, 0, SOFTWARE_DISK_BLOCK_SIZE);
 }
 
-void close_file(File file)
-{  
-    if (file == NULL || !file->directoryEntry->isFileOpen) {
-        fserror = FS_FILE_NOT_OPEN;
-        return;
-    }
-    // printf("CLOSING: File name: %s\n", file->directoryEntry->name);
-    if (findDirEntry("superfile") != -1) {
-        // printf("Found the superfile\n");
-    }
-    else {
-        // printf("didnt find the superfile\n");
-    }
-    file->directoryEntry->isFileOpen = false;
+// returns how many data blocks can still be allocated or promised
+uint16_t available_data_blocks(void)
+{
+    return allocator.freeDataBlocks > allocator.delayedBlocks ? allocator.freeDataBlocks - allocator.delayedBlocks : 0;
+}
 
-    fserror = FS_NONE;
-    if (!write_to_disk(file->directoryEntry, DIRECTORY_ENTRY, file->directoryEntry->inodeBlockNum + MAX_NUMBER_OF_FILES)) {
-        fserror = FS_IO_ERROR;
-    }
-    free(file);
+// marks data block j used, the next search starts just past it
+void claim_data_block(uint16_t j)
+{
+    set_bit(&bitmap, j);
+    allocator.freeDataBlocks--;
+    allocator.nextDataBlock = j + 1 < FILE_SYSTEM_SIZE ? j + 1 : FILE_DATA_FIRST_BLOCKNUM;
 }
 
-uint64_t read_file(File file, void *buf, uint64_t numbytes)
+// the caller holds allocLock
+void release_data_block_locked(uint16_t j)
 {
-    if (!file->directoryEntry->isFileOpen)
+    if (j >= FILE_DATA_FIRST_BLOCKNUM && is_bit_set(&bitmap, j))
     {
-        fserror = FS_FILE_NOT_OPEN;
-        return 0;
+        clear_bit(&bitmap, j);
+        allocator.freeDataBlocks++;
     }
+}
 
-    fserror = FS_NONE;
+void release_data_block(uint16_t j)
+{
+    pthread_mutex_lock(&allocLock);
+    release_data_block_locked(j);
+    pthread_mutex_unlock(&allocLock);
+}
 
-    // char *tempBuf = malloc(numbytes * sizeof(char));
-    unsigned char *tempBuf = calloc(numbytes, sizeof(char)); // initialize it with zeros too
-    uint64_t bytesRead = 0;
+// frees data block j once the running transaction commits, called in
+// the journal handle that stops using it. Until then the block stays
+// set in the in-memory bitmap, so no new data can reach it before the
+// update that freed it is durable
+void release_data_block_after_commit(uint16_t j)
+{
+    pthread_mutex_lock(&allocLock);
+    if (j >= FILE_DATA_FIRST_BLOCKNUM && is_bit_set(&bitmap, j) && !is_bit_set(&pendingFree, j))
+    {
+        set_bit(&pendingFree, j);
+        allocator.pendingFreeBlocks++;
+    }
+    pthread_mutex_unlock(&allocLock);
+}
+
+// commits the running transaction if it frees data blocks, so an
+// allocation that found the disk full can try again. false if nothing
+// was freed. Not called inside a journal handle
+bool commit_pending_blocks(void)
+{
+    pthread_mutex_lock(&allocLock);
+    bool pending = allocator.pendingFreeBlocks > 0;
+    pthread_mutex_unlock(&allocLock);
+    return pending && journal_commit();
+}
 
-    int32_t size = file->inode->size;
+void claim_inode(uint16_t inodeNum)
+{
+    set_bit(&inodeBitmap, inodeNum);
+    allocator.freeInodes--;
+}
 
-    int16_t blockIndex = file->filePosition / SOFTWARE_DISK_BLOCK_SIZE;
-    int16_t positionInBlock = file->filePosition % SOFTWARE_DISK_BLOCK_SIZE;
-    int16_t indirectBlockIndex = 0;
-    if (blockIndex > NUM_DIRECT_INODE_BLOCKS)
+void release_inode(uint16_t inodeNum)
+{
+    pthread_mutex_lock(&allocLock);
+    if (is_bit_set(&inodeBitmap, inodeNum))
     {
-        indirectBlockIndex = blockIndex - NUM_DIRECT_INODE_BLOCKS;
-        blockIndex = NUM_DIRECT_INODE_BLOCKS;
+        clear_bit(&inodeBitmap, inodeNum);
+        allocator.freeInodes++;
     }
-    int16_t currBlock = blockIndex;
+    pthread_mutex_unlock(&allocLock);
+}
 
-    // 13 direct + 1 indirect block, so dont want to exceed. 0 is a not set block
-    while (currBlock <= NUM_DIRECT_INODE_BLOCKS+1 && indirectBlockIndex < MAX_INDIRECT_BLOCK && file->inode->blocks[currBlock] != 0 && bytesRead + (uint64_t)file->filePosition < (uint64_t)size)
+// promises count blocks to a buffered write, false when there is no
+// room left for all of them even after committing blocks being freed
+bool promise_data_blocks(uint16_t count)
+{
+    for (;;)
     {
-        if (currBlock > NUM_DIRECT_INODE_BLOCKS) // at indirect block
+        pthread_mutex_lock(&allocLock);
+        bool promised = available_data_blocks() >= count;
+        if (promised)
         {
-            int16_t currIndirectBlock = indirectBlockIndex;
-            uint16_t *indirectBlocks = (uint16_t *)read_from_disk(BLOCKS, file->inode->blocks[NUM_DIRECT_INODE_BLOCKS]);
-
-            while (currIndirectBlock < MAX_INDIRECT_BLOCK && indirectBlocks[currIndirectBlock] != 0 && (int32_t)bytesRead + (int32_t)file->filePosition < size)
-            {
-                // READ WHAT IS IN FRONT STARTING AT POSITION IN BLOCK
-                // unsigned char *currBuf = malloc((SOFTWARE_DISK_BLOCK_SIZE - positionInBlock + 1) * sizeof(char));
-                // Software disk block size is 1024, so subtract the current position to get how many bytes you need to read total
-                //  Ex: if positionInBlock is 0 then we want to read SOFTWARE_DISK_BLOCK_SIZE size data, not positionInBlock size data
-                unsigned char *currBuf = read_data_from_disk((uint16_t)indirectBlocks[currIndirectBlock], positionInBlock);
-                // for every iteration other than the first iteration the position is 0
-                if (currBuf == NULL)
-                {
-                    fserror = FS_IO_ERROR;
-                    break;
-                }
-
-                uint64_t currLength = strlen((const char *) currBuf);
-                uint64_t bytesLeftToRead = numbytes - bytesRead;
-                // going to read more than the length of the file
-                if ((int32_t)bytesLeftToRead + (int32_t)file->filePosition > file->inode->size)
-                {
-                    bytesLeftToRead = file->inode->size - file->filePosition;
-                }
+            allocator.delayedBlocks += count;
+        }
+        pthread_mutex_unlock(&allocLock);
+        if (promised || !commit_pending_blocks())
+        {
+            return promised;
+        }
+    }
+}
 
-                if (currLength + bytesRead < numbytes)
-                { // not done reading numbytes
-
-                    // reads the smaller amount of data
-                    if (SOFTWARE_DISK_BLOCK_SIZE - (uint64_t)positionInBlock < bytesLeftToRead)
-                    {
-                        bytesLeftToRead = SOFTWARE_DISK_BLOCK_SIZE - positionInBlock;
-                        strncat((char *)tempBuf, (const char *) currBuf, bytesLeftToRead);
-                        bytesRead += bytesLeftToRead;
-                    }
-                    else
-                    {
-                        // WE ARE DONE READING RAN OUT OF SPACE
-                        strncat((char *)tempBuf, (const char *) currBuf, bytesLeftToRead);
-                        bytesRead += bytesLeftToRead;
-                        break;
-                    }
-                }
-                else
-                { // last read of numbytes
-
-                    // numbytes - bytesRead will never be greater than SOFTWARE_DISK_BLOCK_SIZE because of the previous if statement
-                    if (bytesLeftToRead > numbytes - bytesRead)
-                    { // if the end of the file comes after how far I want to read
-                        bytesLeftToRead = numbytes - bytesRead;
-                    }
-                    strncat((char *)tempBuf, (const char *) currBuf, bytesLeftToRead);
-                    bytesRead += bytesLeftToRead;
+// copies the in-memory bitmaps to their blocks in the running
+// transaction, called inside a journal handle
+bool write_bitmaps(bool dataBitmap, bool inodeBitmapToo)
+{
+    unsigned char *dataBlock = dataBitmap ? journal_get_block(BITMAP_BLOCKNUM) : NULL;
+    unsigned char *inodeBlock = inodeBitmapToo ? journal_get_block(INODE_BITMAP_BLOCKNUM) : NULL;
+    if ((dataBitmap && dataBlock == NULL) || (inodeBitmapToo && inodeBlock == NULL))
+    {
+        return false;
+    }
+    // blocks waiting for the commit are free on disk
+    pthread_mutex_lock(&allocLock);
+    if (dataBlock)
+    {
+        for (uint16_t i = 0; i < SOFTWARE_DISK_BLOCK_SIZE; i++)
+        {
+            dataBlock[i] = bitmap.map[i] & ~pendingFree.map[i];
+        }
+    }
+    if (inodeBlock)
+    {
+        memcpy(inodeBlock, inodeBitmap.map, SOFTWARE_DISK_BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&allocLock);
+    return true;
+}
+
+// INODE HELPERS:
+// inode n lives in slot n % 32 of inode block n / 32. Both are called
+// inside a journal handle
+bool read_inode(uint16_t inodeNum, Inode *inode)
+{
+    uint16_t blocknum = INODE_FIRST_BLOCKNUM + inodeNum / INODES_PER_BLOCK;
+    InodeBlock *inodeBlock = (InodeBlock *)journal_pin_block(blocknum);
+    if (inodeBlock == NULL)
+    {
+        return false;
+    }
+    *inode = inodeBlock->inodes[inodeNum % INODES_PER_BLOCK];
+    journal_unpin_block(blocknum, (unsigned char *)inodeBlock);
+    return true;
+}
+
+bool write_inode(uint16_t inodeNum, Inode *inode)
+{
+    uint16_t blocknum = INODE_FIRST_BLOCKNUM + inodeNum / INODES_PER_BLOCK;
+    InodeBlock *inodeBlock = (InodeBlock *)journal_get_block(blocknum);
+    if (inodeBlock == NULL)
+    {
+        return false;
+    }
+    inodeBlock->inodes[inodeNum % INODES_PER_BLOCK] = *inode;
+    return true;
+}
+
+// NAME INDEX HELPERS:
+// FNV-1a hash of a file name
+uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool name_index_insert(const char *name, uint16_t dirEntryBlockNum, uint16_t dirEntryOffset)
+{
+    size_t length = strlen(name);
+    NameIndexEntry *entry = malloc(sizeof(NameIndexEntry) + length + 1);
+    if (!entry)
+    {
+        return false;
+    }
+    entry->hash = hash_name(name);
+    entry->dirEntryBlockNum = dirEntryBlockNum;
+    entry->dirEntryOffset = dirEntryOffset;
+    memcpy(entry->name, name, length + 1);
+
+    NameIndexEntry **bucket = &nameIndex[entry->hash & (NAME_INDEX_BUCKETS - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    return true;
+}
+
+void name_index_remove(const char *name)
+{
+    uint32_t hash = hash_name(name);
+    NameIndexEntry **link = &nameIndex[hash & (NAME_INDEX_BUCKETS - 1)];
+    while (*link)
+    {
+        NameIndexEntry *entry = *link;
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+        {
+            *link = entry->next;
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+// returns the index entry for name or NULL
+NameIndexEntry *name_index_lookup(const char *name)
+{
+    uint32_t hash = hash_name(name);
+    for (NameIndexEntry *entry = nameIndex[hash & (NAME_INDEX_BUCKETS - 1)]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// DIRECTORY HELPERS:
+// returns the length of the record at offset in a pinned dir block. A
+// block that was never used is all zeros, so a 0 length record runs to
+// the end of the block
+uint16_t dir_record_length(unsigned char *block, uint16_t offset)
+{
+    DirEntry *entry = (DirEntry *)(block + offset);
+    return entry->recordLength ? entry->recordLength : SOFTWARE_DISK_BLOCK_SIZE - offset;
+}
+
+// packs a new record for name into the first directory block with room,
+// either reusing an unused record or splitting the slack off the end of
+// a used one. Returns where it went. Called inside a journal handle
+bool dir_entry_insert(const char *name, uint16_t inodeNum, uint16_t *blocknumOut, uint16_t *offsetOut)
+{
+    uint16_t nameLength = strlen(name);
+    uint16_t needed = DIR_RECORD_SIZE(nameLength);
+
+    for (uint16_t blocknum = DIR_ENTRY_FIRST_BLOCKNUM; blocknum < DIR_ENTRY_FIRST_BLOCKNUM + DIR_ENTRY_NUM_BLOCKS; blocknum++)
+    {
+        unsigned char *block = journal_pin_block(blocknum);
+        if (block == NULL)
+        {
+            return false;
+        }
+
+        for (uint16_t offset = 0; offset < SOFTWARE_DISK_BLOCK_SIZE; offset += dir_record_length(block, offset))
+        {
+            DirEntry *entry = (DirEntry *)(block + offset);
+            uint16_t length = dir_record_length(block, offset);
+            uint16_t used = entry->nameLength ? DIR_RECORD_SIZE(entry->nameLength) : 0;
+            if (length - used < needed)
+            {
+                continue;
+            }
+
+            // the record goes into the transaction's image of the block
+            journal_unpin_block(blocknum, block);
+            block = journal_get_block(blocknum);
+            if (block == NULL)
+            {
+                return false;
+            }
+            entry = (DirEntry *)(block + offset);
+            if (used) // split, the new record takes the slack
+            {
+                entry->recordLength = used;
+                offset += used;
+                length -= used;
+                entry = (DirEntry *)(block + offset);
+            }
+            entry->inodeNum = inodeNum;
+            entry->recordLength = length;
+            entry->nameLength = nameLength;
+            entry->isFileOpen = false;
+            entry->reserved = 0;
+            memcpy(entry->name, name, nameLength + 1);
+
+            *blocknumOut = blocknum;
+            *offsetOut = offset;
+            return true;
+        }
+        journal_unpin_block(blocknum, block);
+    }
+    fserror = FS_OUT_OF_SPACE;
+    return false;
+}
+
+// frees the record at offset, merging it into the record before it.
+// Called inside a journal handle
+bool dir_entry_remove(uint16_t blocknum, uint16_t offset)
+{
+    unsigned char *block = journal_get_block(blocknum);
+    if (block == NULL)
+    {
+        return false;
+    }
+    DirEntry *entry = (DirEntry *)(block + offset);
+    entry->nameLength = 0;
+
+    uint16_t prev = 0;
+    for (uint16_t curr = 0; curr < offset; curr += dir_record_length(block, curr))
+    {
+        prev = curr;
+    }
+    if (prev != offset)
+    {
+        ((DirEntry *)(block + prev))->recordLength += entry->recordLength;
+    }
+    return true;
+}
+
+// replays the journal, loads the bitmap and builds the name index from
+// the dir entries, called with mountLock held. Nothing is in the running
+// transaction yet, so the blocks are read straight from the disk
+bool mount_fs_locked(void)
+{
+    if (!journal_recover())
+    {
+        fserror = FS_IO_ERROR;
+        return false;
+    }
+    if (!read_sd_block(bitmap.map, BITMAP_BLOCKNUM) || !read_sd_block(inodeBitmap.map, INODE_BITMAP_BLOCKNUM))
+    {
+        fserror = FS_IO_ERROR;
+        return false;
+    }
+    reset_allocator();
+    for (uint16_t i = DIR_ENTRY_FIRST_BLOCKNUM; i < DIR_ENTRY_FIRST_BLOCKNUM + DIR_ENTRY_NUM_BLOCKS; i++)
+    {
+        unsigned char *block = pin_sd_block(i);
+        if (block == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return false;
+        }
+        for (uint16_t offset = 0; offset < SOFTWARE_DISK_BLOCK_SIZE; offset += dir_record_length(block, offset))
+        {
+            DirEntry *dirEntry = (DirEntry *)(block + offset);
+            if (dirEntry->nameLength && !name_index_insert(dirEntry->name, i, offset))
+            {
+                unpin_sd_block(i);
+                fserror = FS_IO_ERROR;
+                return false;
+            }
+        }
+        unpin_sd_block(i);
+    }
+    // only a mounted filesystem has anything to write back at exit, and
+    // this is reached once
+    atexit(journal_exit);
+    atomic_store_explicit(&mounted, true, memory_order_release);
+    return true;
+}
+
+// mounts the filesystem the first time it is used, by whichever thread
+// gets there first. Once it's mounted no lock is taken, so the public
+// calls don't all queue on mountLock
+bool mount_fs(void)
+{
+    if (atomic_load_explicit(&mounted, memory_order_acquire))
+    {
+        return true;
+    }
+    pthread_mutex_lock(&mountLock);
+    bool success = mounted || mount_fs_locked();
+    pthread_mutex_unlock(&mountLock);
+    return success;
+}
+
+// try to find an existing directory entry through the name index.
+// Returns NULL if there isn't one. The caller has mounted the
+// filesystem and holds dirLock
+NameIndexEntry *findDirEntry(char *name)
+{
+    return name_index_lookup(name);
+}
+
+// finds free space in the bitmap, next-fit from the cursor and wrapping
+// around to the first data block. Doesn't allocate it, the caller holds
+// allocLock
+int16_t findFreeDataSpace(void)
+{
+    if (available_data_blocks() == 0)
+    {
+        return -1;
+    }
+    int32_t j = find_clear_bit(&bitmap, allocator.nextDataBlock, FILE_SYSTEM_SIZE);
+    if (j == -1)
+    {
+        j = find_clear_bit(&bitmap, FILE_DATA_FIRST_BLOCKNUM, allocator.nextDataBlock);
+    }
+    return j;
+}
+
+// finds a free inode number in the inode bitmap, the caller holds
+// allocLock
+int16_t findFreeInodeSpace(void)
+{
+    if (allocator.freeInodes == 0)
+    {
+        return -1;
+    }
+    return find_clear_bit(&inodeBitmap, 0, MAX_NUMBER_OF_FILES);
+}
+
+// finds and claims a free data block, -1 when the disk is full. The
+// caller holds allocLock
+int16_t allocate_data_block(void)
+{
+    int16_t j = findFreeDataSpace();
+    if (j != -1)
+    {
+        claim_data_block((uint16_t)j);
+    }
+    return j;
+}
+
+// claims up to want free data blocks that are next to each other,
+// starting at the first free block from the cursor. Returns how many it
+// got, the run starts at *start. 0 means the disk is full. The caller
+// holds allocLock
+uint16_t allocate_data_run(uint16_t want, uint16_t *start)
+{
+    int16_t j = findFreeDataSpace();
+    if (j == -1 || want == 0)
+    {
+        return 0;
+    }
+    if (want > available_data_blocks())
+    {
+        want = available_data_blocks();
+    }
+    uint32_t end = find_set_bit(&bitmap, (uint32_t)j, FILE_SYSTEM_SIZE);
+    // prefer a later run that holds the whole request to splitting it
+    uint32_t from = end;
+    while (end - j < want)
+    {
+        int32_t k = find_clear_bit(&bitmap, from, FILE_SYSTEM_SIZE);
+        if (k == -1)
+        {
+            break;
+        }
+        uint32_t kEnd = find_set_bit(&bitmap, (uint32_t)k, FILE_SYSTEM_SIZE);
+        if (kEnd - k >= want)
+        {
+            j = k;
+            end = kEnd;
+            break;
+        }
+        from = kEnd;
+    }
+    uint16_t length = end - j < want ? end - j : want;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        claim_data_block((uint16_t)j + i);
+    }
+    *start = (uint16_t)j;
+    return length;
+}
+
+// FILE BLOCK HELPERS:
+// grows the extent map's arrays to hold at least n extents
+bool extent_map_reserve(ExtentMap *map, uint32_t n)
+{
+    if (n <= map->capacity)
+    {
+        return true;
+    }
+    uint32_t capacity = map->capacity ? map->capacity * 2 : 16;
+    while (capacity < n)
+    {
+        capacity *= 2;
+    }
+    Extent *extents = realloc(map->extents, capacity * sizeof(Extent));
+    if (extents)
+    {
+        map->extents = extents;
+    }
+    uint32_t *ends = realloc(map->ends, capacity * sizeof(uint32_t));
+    if (ends)
+    {
+        map->ends = ends;
+    }
+    if (!extents || !ends)
+    {
+        return false;
+    }
+    map->capacity = capacity;
+    return true;
+}
+
+void free_extent_map(ExtentMap *map)
+{
+    if (map)
+    {
+        free(map->extents);
+        free(map->ends);
+        free(map->overflowBlocks);
+        free(map);
+    }
+}
+
+// returns the file's extent map, reading the overflow blocks the first
+// time it's needed. NULL on failure
+ExtentMap *load_extent_map(File file)
+{
+    if (file->node->extentMap)
+    {
+        return file->node->extentMap;
+    }
+    Inode *inode = &file->node->inode;
+    ExtentMap *map = calloc(1, sizeof(ExtentMap));
+    if (!map || !extent_map_reserve(map, inode->numExtents))
+    {
+        free_extent_map(map);
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+
+    uint32_t end = 0;
+    uint16_t inodeExtents = inode->numExtents < INODE_NUM_EXTENTS ? inode->numExtents : INODE_NUM_EXTENTS;
+    for (uint16_t i = 0; i < inodeExtents; i++)
+    {
+        end += inode->extents[i].length;
+        map->extents[map->count] = inode->extents[i];
+        map->ends[map->count++] = end;
+    }
+
+    for (uint16_t blocknum = inode->overflowBlock; blocknum != 0;)
+    {
+        uint16_t *overflowBlocks = realloc(map->overflowBlocks, (map->numOverflowBlocks + 1) * sizeof(uint16_t));
+        ExtentBlock *extentBlock = overflowBlocks ? (ExtentBlock *)journal_pin_block(blocknum) : NULL;
+        if (overflowBlocks)
+        {
+            map->overflowBlocks = overflowBlocks;
+        }
+        if (extentBlock == NULL || !extent_map_reserve(map, map->count + extentBlock->numExtents))
+        {
+            if (extentBlock)
+            {
+                journal_unpin_block(blocknum, (unsigned char *)extentBlock);
+            }
+            free_extent_map(map);
+            fserror = FS_IO_ERROR;
+            return NULL;
+        }
+        map->overflowBlocks[map->numOverflowBlocks++] = blocknum;
+        for (uint16_t i = 0; i < extentBlock->numExtents; i++)
+        {
+            end += extentBlock->extents[i].length;
+            map->extents[map->count] = extentBlock->extents[i];
+            map->ends[map->count++] = end;
+        }
+        uint16_t next = extentBlock->next;
+        journal_unpin_block(blocknum, (unsigned char *)extentBlock);
+        blocknum = next;
+    }
+    file->node->extentMap = map;
+    return map;
+}
+
+// writes the extents past the inode's own back to the overflow blocks if
+// they changed
+bool flush_extent_map(File file)
+{
+    ExtentMap *map = file->node->extentMap;
+    if (!map || !map->dirty)
+    {
+        return true;
+    }
+    journal_start(map->numOverflowBlocks);
+    for (uint16_t b = 0; b < map->numOverflowBlocks; b++)
+    {
+        ExtentBlock *extentBlock = (ExtentBlock *)journal_get_block(map->overflowBlocks[b]);
+        if (extentBlock == NULL)
+        {
+            journal_stop(map->numOverflowBlocks);
+            return false;
+        }
+        uint32_t first = INODE_NUM_EXTENTS + (uint32_t)b * EXTENTS_PER_BLOCK;
+        uint32_t n = map->count - first < EXTENTS_PER_BLOCK ? map->count - first : EXTENTS_PER_BLOCK;
+        memset(extentBlock, 0, sizeof(ExtentBlock));
+        extentBlock->next = b + 1 < map->numOverflowBlocks ? map->overflowBlocks[b + 1] : 0;
+        extentBlock->numExtents = n;
+        memcpy(extentBlock->extents, map->extents + first, n * sizeof(Extent));
+    }
+    journal_stop(map->numOverflowBlocks);
+    map->dirty = false;
+    return true;
+}
+
+// returns the disk block holding block index of a file, 0 if the file
+// isn't that long. *runLength is set to how many blocks from there on
+// are contiguous, up to the end of the extent. Binary searches the
+// extent map for the first extent ending past index
+uint16_t file_block_run(File file, uint32_t index, uint32_t *runLength)
+{
+    *runLength = 0;
+    ExtentMap *map = load_extent_map(file);
+    if (map == NULL || map->count == 0 || index >= map->ends[map->count - 1])
+    {
+        return 0;
+    }
+    uint32_t low = 0, high = map->count - 1;
+    while (low < high)
+    {
+        uint32_t mid = (low + high) / 2;
+        if (map->ends[mid] <= index)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    *runLength = map->ends[low] - index;
+    return map->extents[low].start + (map->extents[low].length - *runLength);
+}
+
+// returns the disk block holding block index of a file, 0 if the file
+// isn't that long
+uint16_t file_block_num(File file, uint32_t index)
+{
+    uint32_t runLength;
+    return file_block_run(file, index, &runLength);
+}
+
+// returns the number of data blocks a file has
+uint32_t file_num_blocks(File file)
+{
+    ExtentMap *map = load_extent_map(file);
+    return map && map->count ? map->ends[map->count - 1] : 0;
+}
+
+// adds the run start .. start + length - 1 to the end of a file. A run
+// that continues the last extent just makes it longer, otherwise it
+// becomes a new extent, in the inode while there is room and then in the
+// overflow blocks, chaining on a new one when the last is full. The
+// caller holds allocLock
+bool append_extent(File file, uint16_t start, uint16_t length)
+{
+    Inode *inode = &file->node->inode;
+    ExtentMap *map = load_extent_map(file);
+    if (map == NULL)
+    {
+        return false;
+    }
+
+    uint32_t end = map->count ? map->ends[map->count - 1] : 0;
+    Extent *last = map->count ? &map->extents[map->count - 1] : NULL;
+    if (last && last->start + last->length == start)
+    {
+        last->length += length;
+        map->ends[map->count - 1] = end + length;
+        if (map->count <= INODE_NUM_EXTENTS)
+        {
+            inode->extents[map->count - 1].length = last->length;
+        }
+        else
+        {
+            map->dirty = true;
+        }
+        return true;
+    }
+
+    if (!extent_map_reserve(map, map->count + 1))
+    {
+        fserror = FS_IO_ERROR;
+        return false;
+    }
+    if (map->count >= INODE_NUM_EXTENTS &&
+        map->count - INODE_NUM_EXTENTS == (uint32_t)map->numOverflowBlocks * EXTENTS_PER_BLOCK)
+    {
+        uint16_t *overflowBlocks = realloc(map->overflowBlocks, (map->numOverflowBlocks + 1) * sizeof(uint16_t));
+        if (overflowBlocks == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return false;
+        }
+        map->overflowBlocks = overflowBlocks;
+        int16_t blocknum = allocate_data_block();
+        if (blocknum == -1)
+        {
+            fserror = FS_OUT_OF_SPACE;
+            return false;
+        }
+        if (map->numOverflowBlocks == 0)
+        {
+            inode->overflowBlock = (uint16_t)blocknum;
+        }
+        map->overflowBlocks[map->numOverflowBlocks++] = (uint16_t)blocknum;
+    }
+
+    map->extents[map->count].start = start;
+    map->extents[map->count].length = length;
+    map->ends[map->count] = end + length;
+    if (map->count < INODE_NUM_EXTENTS)
+    {
+        inode->extents[map->count] = map->extents[map->count];
+    }
+    else
+    {
+        map->dirty = true;
+    }
+    map->count++;
+    inode->numExtents = map->count;
+    return true;
+}
+
+// makes a file at least last + 1 blocks long, taking the new blocks in
+// contiguous runs so a sequential write lands on sequential blocks and
+// usually just grows the last extent. Blocks between the old end of the
+// file and the write are filled in too. Only the in-memory bitmap and
+// inode change, *allocated says whether the caller has to write them
+// back. Returns false if the disk filled up, in which case part of the
+// range may have been allocated. The caller holds allocLock
+bool reserve_file_blocks_locked(File file, uint32_t last, bool *allocated)
+{
+    uint32_t have = file_num_blocks(file);
+    *allocated = false;
+    if (have > last)
+    {
+        return true;
+    }
+
+    bool success = true;
+    while (have <= last)
+    {
+        uint16_t start;
+        uint16_t length = allocate_data_run((uint16_t)(last + 1 - have), &start);
+        if (length == 0)
+        {
+            fserror = FS_OUT_OF_SPACE;
+            success = false;
+            break;
+        }
+        if (!append_extent(file, start, length))
+        {
+            for (uint16_t i = 0; i < length; i++)
+            {
+                release_data_block_locked(start + i);
+            }
+            success = false;
+            break;
+        }
+        have += length;
+        *allocated = true;
+    }
+    return success;
+}
+
+// same, taking allocLock, and committing blocks being freed to try
+// again when the disk is full
+bool reserve_file_blocks(File file, uint32_t last, bool *allocated)
+{
+    *allocated = false;
+    for (;;)
+    {
+        bool more;
+        pthread_mutex_lock(&allocLock);
+        bool success = reserve_file_blocks_locked(file, last, &more);
+        pthread_mutex_unlock(&allocLock);
+        *allocated = *allocated || more;
+        if (success || fserror != FS_OUT_OF_SPACE || !commit_pending_blocks())
+        {
+            return success;
+        }
+    }
+}
+
+// overflow blocks a file would have to add to hold newExtents more
+// extents
+uint16_t overflow_blocks_needed(ExtentMap *map, uint32_t newExtents)
+{
+    uint32_t room = INODE_NUM_EXTENTS + (uint32_t)map->numOverflowBlocks * EXTENTS_PER_BLOCK;
+    uint32_t want = map->count + newExtents;
+    return want <= room ? 0 : (want - room + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+}
+
+// frees every data block of a file and its overflow blocks once the
+// running transaction commits, called inside a journal handle. The
+// blocks aren't cleared, reads never go past a file's size
+bool free_file_blocks(Inode *inode)
+{
+    uint16_t inodeExtents = inode->numExtents < INODE_NUM_EXTENTS ? inode->numExtents : INODE_NUM_EXTENTS;
+    for (uint16_t i = 0; i < inodeExtents; i++)
+    {
+        for (uint16_t j = 0; j < inode->extents[i].length; j++)
+        {
+            release_data_block_after_commit(inode->extents[i].start + j);
+        }
+    }
+
+    uint16_t blocknum = inode->overflowBlock;
+    while (blocknum != 0)
+    {
+        ExtentBlock *extentBlock = (ExtentBlock *)journal_pin_block(blocknum);
+        if (extentBlock == NULL)
+        {
+            return false;
+        }
+        for (uint16_t i = 0; i < extentBlock->numExtents; i++)
+        {
+            for (uint16_t j = 0; j < extentBlock->extents[i].length; j++)
+            {
+                release_data_block_after_commit(extentBlock->extents[i].start + j);
+            }
+        }
+        uint16_t next = extentBlock->next;
+        journal_unpin_block(blocknum, (unsigned char *)extentBlock);
+        journal_forget(blocknum);
+        release_data_block_after_commit(blocknum);
+        blocknum = next;
+    }
+    return true;
+}
+
+// READAHEAD HELPERS:
+// called before a read of numbytes at the handle's position. A read
+// that starts where the last one ended grows the window, anything else
+// drops it. The window of blocks past the end of this read is prefetched into
+// the block cache, one prefetch per extent, skipping blocks an earlier
+// call already asked for
+void file_readahead(File file, uint64_t numbytes)
+{
+    if (file->filePosition != file->nextReadPosition)
+    {
+        file->readaheadBlocks = 0;
+        file->readaheadEnd = 0;
+        return;
+    }
+    if (file->readaheadBlocks == 0)
+    {
+        file->readaheadBlocks = READAHEAD_MIN_BLOCKS;
+    }
+    else if (file->readaheadBlocks < READAHEAD_MAX_BLOCKS)
+    {
+        file->readaheadBlocks *= 2;
+    }
+
+    uint32_t fileBlocks = (file->node->inode.size + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+    uint32_t first = (file->filePosition + numbytes + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+    uint32_t last = first + file->readaheadBlocks < fileBlocks ? first + file->readaheadBlocks : fileBlocks;
+    uint32_t index = first > file->readaheadEnd ? first : file->readaheadEnd;
+    while (index < last)
+    {
+        uint32_t runLength;
+        uint16_t blocknum = file_block_run(file, index, &runLength);
+        if (blocknum == 0)
+        {
+            break;
+        }
+        if (runLength > last - index)
+        {
+            runLength = last - index;
+        }
+        if (!prefetch_sd_blocks(blocknum, runLength))
+        {
+            break;
+        }
+        index += runLength;
+    }
+    if (index > file->readaheadEnd)
+    {
+        file->readaheadEnd = index;
+    }
+}
+
+// WRITE HELPERS:
+// copies numbytes at offset to the file's blocks, whole blocks a run at
+// a time and partial ones through a pin. Returns how many bytes made it,
+// stopping at the first block that wasn't allocated
+uint64_t write_direct(File file, void *buf, uint64_t numbytes, uint32_t offset)
+{
+    uint64_t bytesWritten = 0;
+    while (bytesWritten < numbytes)
+    {
+        uint32_t position = offset + bytesWritten;
+        uint16_t positionInBlock = position % SOFTWARE_DISK_BLOCK_SIZE;
+        uint32_t runLength;
+        uint16_t blocknum = file_block_run(file, position / SOFTWARE_DISK_BLOCK_SIZE, &runLength);
+        if (blocknum == 0)
+        {
+            if (fserror == FS_NONE)
+            {
+                fserror = FS_OUT_OF_SPACE;
+            }
+            break;
+        }
+        uint64_t bytesToWrite = numbytes - bytesWritten;
+        uint64_t remainingSpaceInBlock = SOFTWARE_DISK_BLOCK_SIZE - positionInBlock;
+        uint64_t wholeBlocks = positionInBlock ? 0 : bytesToWrite / SOFTWARE_DISK_BLOCK_SIZE;
+        if (bytesToWrite > remainingSpaceInBlock)
+        {
+            bytesToWrite = remainingSpaceInBlock;
+        }
+
+        if (wholeBlocks)
+        {
+            // overwriting whole blocks, nothing to read back first and one
+            // disk write for the rest of the extent
+            uint16_t count = wholeBlocks < runLength ? wholeBlocks : runLength;
+            if (!write_sd_blocks((unsigned char *)buf + bytesWritten, blocknum, count))
+            {
+                fserror = FS_IO_ERROR;
+                break;
+            }
+            bytesToWrite = (uint64_t)count * SOFTWARE_DISK_BLOCK_SIZE;
+        }
+        else
+        {
+            unsigned char *block = pin_sd_block(blocknum);
+            if (block == NULL)
+            {
+                fserror = FS_IO_ERROR;
+                break;
+            }
+            memcpy(block + positionInBlock, (unsigned char *)buf + bytesWritten, bytesToWrite);
+            mark_sd_block_dirty(blocknum);
+            unpin_sd_block(blocknum);
+        }
+        bytesWritten += bytesToWrite;
+    }
+    return bytesWritten;
+}
+
+// writes every buffered block to disk, one write per extent. Blocks past
+// the end of the file's extents get their disk blocks only now, all in
+// one go, so the allocator sees the whole window and can place it in one
+// run. The promised space is handed back and taken for real under one
+// hold of allocLock, so no other thread can get at it in between. What a
+// failed flush didn't take stays promised and the buffer is kept
+bool flush_write_buffer(File file)
+{
+    OpenInode *node = file->node;
+    if (node->bufferBlocks == 0)
+    {
+        return true;
+    }
+    uint32_t bufferEnd = node->bufferStart + node->bufferBlocks;
+    bool allocated;
+    pthread_mutex_lock(&allocLock);
+    allocator.delayedBlocks -= node->promisedBlocks;
+    uint16_t freeBefore = allocator.freeDataBlocks;
+    bool reserved = reserve_file_blocks_locked(file, bufferEnd - 1, &allocated);
+    uint16_t claimed = freeBefore - allocator.freeDataBlocks;
+    node->promisedBlocks = reserved || claimed >= node->promisedBlocks ? 0 : node->promisedBlocks - claimed;
+    allocator.delayedBlocks += node->promisedBlocks;
+    pthread_mutex_unlock(&allocLock);
+    uint32_t fileBlocks = file_num_blocks(file);
+    node->delayedBlocks = bufferEnd > fileBlocks ? bufferEnd - (fileBlocks > node->bufferStart ? fileBlocks : node->bufferStart) : 0;
+    if (allocated)
+    {
+        file->node->inodeDirty = true;
+        file->node->bitmapDirty = true;
+    }
+    if (!reserved)
+    {
+        return false;
+    }
+
+    uint16_t slot = 0;
+    while (slot < file->node->bufferBlocks)
+    {
+        uint32_t runLength;
+        uint16_t blocknum = file_block_run(file, file->node->bufferStart + slot, &runLength);
+        if (blocknum == 0)
+        {
+            fserror = FS_IO_ERROR;
+            return false;
+        }
+        uint16_t count = file->node->bufferBlocks - slot < runLength ? file->node->bufferBlocks - slot : runLength;
+        if (!write_sd_blocks(file->node->writeBuffer + (size_t)slot * SOFTWARE_DISK_BLOCK_SIZE, blocknum, count))
+        {
+            fserror = FS_IO_ERROR;
+            return false;
+        }
+        slot += count;
+    }
+    file->node->bufferBlocks = 0;
+    return true;
+}
+
+// promises space for one more buffer block that has no disk block yet,
+// and for the overflow block its extent could need if every such block
+// ends up an extent of its own. false when there is no room left
+bool promise_buffer_block(File file)
+{
+    OpenInode *node = file->node;
+    ExtentMap *map = load_extent_map(file);
+    if (map == NULL)
+    {
+        return false;
+    }
+    uint16_t count = 1 + overflow_blocks_needed(map, node->delayedBlocks + 1) - overflow_blocks_needed(map, node->delayedBlocks);
+    if (!promise_data_blocks(count))
+    {
+        fserror = FS_OUT_OF_SPACE;
+        return false;
+    }
+    node->delayedBlocks++;
+    node->promisedBlocks += count;
+    return true;
+}
+
+// copies a small write at offset into the file's write buffer, a window of
+// consecutive file blocks. A write outside the window, or past a full
+// one, flushes it and starts a new window. A block the write only partly
+// covers is read in first if the file has data there. New blocks are
+// only promised space here, they're allocated when the window is flushed
+uint64_t write_buffered(File file, void *buf, uint64_t numbytes, uint32_t offset)
+{
+    if (file->node->writeBuffer == NULL)
+    {
+        file->node->writeBuffer = malloc(WRITE_BUFFER_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE);
+        if (file->node->writeBuffer == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+    }
+
+    uint64_t bytesWritten = 0;
+    while (bytesWritten < numbytes)
+    {
+        uint32_t position = offset + bytesWritten;
+        uint32_t index = position / SOFTWARE_DISK_BLOCK_SIZE;
+        uint16_t positionInBlock = position % SOFTWARE_DISK_BLOCK_SIZE;
+        uint64_t bytesToWrite = numbytes - bytesWritten;
+        if (bytesToWrite > (uint64_t)(SOFTWARE_DISK_BLOCK_SIZE - positionInBlock))
+        {
+            bytesToWrite = SOFTWARE_DISK_BLOCK_SIZE - positionInBlock;
+        }
+
+        uint32_t bufferEnd = file->node->bufferStart + file->node->bufferBlocks;
+        if (file->node->bufferBlocks &&
+            (index < file->node->bufferStart || index > bufferEnd || (index == bufferEnd && file->node->bufferBlocks == WRITE_BUFFER_BLOCKS)))
+        {
+            if (!flush_write_buffer(file))
+            {
+                break;
+            }
+        }
+        if (file->node->bufferBlocks == 0)
+        {
+            file->node->bufferStart = index;
+        }
+
+        unsigned char *slot = file->node->writeBuffer + (size_t)(index - file->node->bufferStart) * SOFTWARE_DISK_BLOCK_SIZE;
+        if (index - file->node->bufferStart == file->node->bufferBlocks)
+        {
+            uint16_t blocknum = file_block_num(file, index);
+            if (blocknum == 0)
+            {
+                if (!promise_buffer_block(file))
+                {
+                    break;
+                }
+            }
+            if (bytesToWrite < SOFTWARE_DISK_BLOCK_SIZE && blocknum != 0 &&
+                (uint64_t)index * SOFTWARE_DISK_BLOCK_SIZE < (uint64_t)file->node->inode.size)
+            {
+                if (!read_sd_block(slot, blocknum))
+                {
+                    fserror = FS_IO_ERROR;
+                    break;
                 }
+            }
+            else if (bytesToWrite < SOFTWARE_DISK_BLOCK_SIZE)
+            {
+                memset(slot, 0, SOFTWARE_DISK_BLOCK_SIZE);
+            }
+            file->node->bufferBlocks++;
+        }
+        memcpy(slot + positionInBlock, (unsigned char *)buf + bytesWritten, bytesToWrite);
+        bytesWritten += bytesToWrite;
+    }
+    return bytesWritten;
+}
+
+// writes the bitmap and inode if a write changed them, as one update
+bool write_file_metadata(File file)
+{
+    if (!file->node->bitmapDirty && !file->node->inodeDirty)
+    {
+        return true;
+    }
+    bool success = true;
+    journal_start(2);
+    if (file->node->bitmapDirty)
+    {
+        success = write_bitmaps(true, false);
+        file->node->bitmapDirty = !success;
+    }
+    if (success && file->node->inodeDirty)
+    {
+        success = write_inode(file->node->inodeNum, &file->node->inode);
+        file->node->inodeDirty = !success;
+    }
+    journal_stop(2);
+    return success;
+}
+
+// the lock of an open file's inode
+pthread_rwlock_t *file_lock(File file)
+{
+    return &inodeLocks[file->node->inodeNum];
+}
+
+// adds a handle with mode to the open file table entry for inodeNum,
+// making the entry on the first open. Only one READ_WRITE handle at a
+// time. Called with the inode's lock held for writing
+OpenInode *open_inode(uint16_t inodeNum, FileMode mode)
+{
+    OpenInode *node = openFiles[inodeNum];
+    if (node && mode == READ_WRITE && node->writer)
+    {
+        fserror = FS_FILE_OPEN;
+        return NULL;
+    }
+    if (node == NULL)
+    {
+        node = calloc(1, sizeof(OpenInode));
+        if (node == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return NULL;
+        }
+        node->inodeNum = inodeNum;
+        if (!read_inode(inodeNum, &node->inode))
+        {
+            free(node);
+            return NULL;
+        }
+        openFiles[inodeNum] = node;
+    }
+    if (mode == READ_WRITE)
+    {
+        node->writer = true;
+    }
+    else
+    {
+        node->readers++;
+    }
+    return node;
+}
+
+// frees an open file table entry once no handle has it and nothing it
+// holds is still waiting to be written. An entry whose sync failed stays
+// in the table, so its buffered data and blocks aren't lost and the next
+// open, sync_all_files() or delete tries again. Called with the inode's
+// lock held for writing
+void release_inode_if_idle(OpenInode *node)
+{
+    if (node->writer || node->readers || node->bufferBlocks || node->inodeDirty || node->bitmapDirty ||
+        (node->extentMap && node->extentMap->dirty))
+    {
+        return;
+    }
+    openFiles[node->inodeNum] = NULL;
+    free(node->writeBuffer);
+    free_extent_map(node->extentMap);
+    free(node);
+}
+
+// drops a handle with mode from its open file table entry. Called with
+// the inode's lock held for writing
+void close_inode(OpenInode *node, FileMode mode)
+{
+    if (mode == READ_WRITE)
+    {
+        node->writer = false;
+    }
+    else
+    {
+        node->readers--;
+    }
+    release_inode_if_idle(node);
+}
+
+// MAIN FUNCTIONS:
+
+// adds the dir entry, inode and first block of a new file, setting
+// *newInodeNum to its inode. Called with dirLock held for writing
+bool create_file_locked(char *name, uint16_t *newInodeNum)
+{
+    // We want the file to not exist yet with that name
+    if (findDirEntry(name) != NULL)
+    {
+        fserror = FS_FILE_ALREADY_EXISTS;
+        return false;
+    }
+
+    // claim the first data block that is available and a free inode
+    // together, so another thread can't take either before the dir entry
+    // exists. They're given back if the dir entry can't be added. A full
+    // disk commits blocks a delete is freeing and tries again
+    int16_t blocknum, inodeNum;
+    do
+    {
+        pthread_mutex_lock(&allocLock);
+        blocknum = findFreeDataSpace();
+        inodeNum = findFreeInodeSpace();
+        if (blocknum != -1 && inodeNum != -1)
+        {
+            claim_data_block((uint16_t)blocknum); // setting bitmap for when we allocate a block to newly opened file data
+            claim_inode((uint16_t)inodeNum); // set the new Inode in the inode bitmap
+        }
+        pthread_mutex_unlock(&allocLock);
+    } while (blocknum == -1 && commit_pending_blocks());
+    if (blocknum == -1 || inodeNum == -1)
+    {
+        fserror = FS_OUT_OF_SPACE;
+        //  printf("CreateFile couldnt find a spot\n");
+        return false;
+    }
+
+    Inode newInode;
+    memset(&newInode, '\0', sizeof(newInode));
+    newInode.extents[0].start = (uint16_t)blocknum;
+    newInode.extents[0].length = 1;
+    newInode.numExtents = 1;
+
+    // the dir entry, inode and bitmaps are committed together
+    uint16_t dirEntryBlockNum, dirEntryOffset;
+    journal_start(JOURNAL_HANDLE_BLOCKS);
+    if (!dir_entry_insert(name, (uint16_t)inodeNum, &dirEntryBlockNum, &dirEntryOffset))
+    {
+        release_data_block((uint16_t)blocknum);
+        release_inode((uint16_t)inodeNum);
+        journal_stop(JOURNAL_HANDLE_BLOCKS);
+        return false;
+    }
+    if (!name_index_insert(name, dirEntryBlockNum, dirEntryOffset))
+    {
+        dir_entry_remove(dirEntryBlockNum, dirEntryOffset);
+        release_data_block((uint16_t)blocknum);
+        release_inode((uint16_t)inodeNum);
+        journal_stop(JOURNAL_HANDLE_BLOCKS);
+        fserror = FS_IO_ERROR;
+        return false;
+    }
+
+    // write the inode, then update the bitmaps
+    bool created = write_inode((uint16_t)inodeNum, &newInode) && write_bitmaps(true, true);
+    journal_stop(JOURNAL_HANDLE_BLOCKS);
+    *newInodeNum = (uint16_t)inodeNum;
+    return created;
+}
+
+// makes a handle with mode on inode inodeNum, called with dirLock held
+File open_file_locked(uint16_t inodeNum, FileMode mode)
+{
+    File file = malloc(sizeof(struct FileInternals));
+    if (file == NULL)
+    {
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+    file->filePosition = 0;
+    file->fileMode = mode;
+    file->isOpen = true;
+    pthread_mutex_init(&file->lock, NULL);
+    file->nextReadPosition = 0;
+    file->readaheadBlocks = 0;
+    file->readaheadEnd = 0;
+    file->writeBack = WRITE_BACK_DEFAULT;
+
+    // the caller holds the dir lock until the file is in the open file
+    // table, so it can't be deleted in between. The extent map is loaded
+    // now so reads, which share the inode lock, never have to build it
+    pthread_rwlock_wrlock(&inodeLocks[inodeNum]);
+    journal_start(0);
+    file->node = open_inode(inodeNum, mode);
+    if (file->node && load_extent_map(file) == NULL)
+    {
+        close_inode(file->node, mode);
+        file->node = NULL;
+    }
+    journal_stop(0);
+    pthread_rwlock_unlock(&inodeLocks[inodeNum]);
+    if (file->node == NULL)
+    {
+        pthread_mutex_destroy(&file->lock);
+        free(file);
+        return NULL;
+    }
+    fserror = FS_NONE;
+    return file;
+}
+
+File create_file(char *name)
+{   
+    // printf("CREATE FILE\n");
+    if (name[0] == '\0' || strlen(name) > MAX_FILE_NAME_SIZE)
+    {
+        fserror = FS_ILLEGAL_FILENAME;
+       // printf("Illegal filename");
+        return NULL;
+    }
+
+    if (!mount_fs())
+    {
+        return NULL;
+    }
+
+    // the new file is opened before the dir lock is dropped, so no other
+    // thread can open or delete it first
+    uint16_t inodeNum;
+    pthread_rwlock_wrlock(&dirLock);
+    File file = create_file_locked(name, &inodeNum) ? open_file_locked(inodeNum, READ_WRITE) : NULL;
+    pthread_rwlock_unlock(&dirLock);
+
+    // printf("END CREATE\n");
+    return file;
+}
+
+File open_file(char *name, FileMode mode)
+{
+    // printf("OPENING\n");
+    if (!mount_fs())
+    {
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&dirLock);
+    NameIndexEntry *index = findDirEntry(name);
+    if (index == NULL)
+    {
+        pthread_rwlock_unlock(&dirLock);
+        fserror = FS_FILE_NOT_FOUND;
+        return NULL;
+    }
+    // printf("File FOund\n");
+
+    journal_start(0);
+    unsigned char *block = journal_pin_block(index->dirEntryBlockNum);
+    uint16_t inodeNum = block ? ((DirEntry *)(block + index->dirEntryOffset))->inodeNum : 0;
+    if (block)
+    {
+        journal_unpin_block(index->dirEntryBlockNum, block);
+    }
+    journal_stop(0);
+    File file = block ? open_file_locked(inodeNum, mode) : NULL;
+    pthread_rwlock_unlock(&dirLock);
+
+    // printf("END OPEN\n");
+    return file;
+}
+
+// writes out everything a file is holding, called with its lock held
+// for writing
+bool sync_file_locked(File file)
+{
+    if (!flush_write_buffer(file) || !flush_extent_map(file) || !write_file_metadata(file))
+    {
+        return false;
+    }
+    fserror = FS_NONE;
+    return true;
+}
+
+bool sync_file(File file)
+{
+    if (file == NULL || !file->isOpen)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return false;
+    }
+    pthread_rwlock_wrlock(file_lock(file));
+    bool synced = sync_file_locked(file);
+    pthread_rwlock_unlock(file_lock(file));
+    if (!synced || !journal_sync())
+    {
+        return false;
+    }
+    fserror = FS_NONE;
+    return true;
+}
+
+bool sync_all_files(void)
+{
+    if (!mount_fs())
+    {
+        return false;
+    }
+    // the sync helpers only look at the handle's open file table entry,
+    // so any open file's writes can go out through a stand-in handle
+    bool synced = true;
+    for (uint16_t inodeNum = 0; inodeNum < MAX_NUMBER_OF_FILES; inodeNum++)
+    {
+        pthread_rwlock_wrlock(&inodeLocks[inodeNum]);
+        if (openFiles[inodeNum] != NULL)
+        {
+            struct FileInternals handle = {.fileMode = READ_WRITE, .isOpen = true, .node = openFiles[inodeNum]};
+            synced = sync_file_locked(&handle) && synced;
+            release_inode_if_idle(handle.node);
+        }
+        pthread_rwlock_unlock(&inodeLocks[inodeNum]);
+    }
+    if (!synced || !journal_sync())
+    {
+        fserror = FS_IO_ERROR;
+        return false;
+    }
+    fserror = FS_NONE;
+    return true;
+}
+
+bool set_file_write_back(File file, bool enabled)
+{
+    if (file == NULL || !file->isOpen)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return false;
+    }
+    pthread_rwlock_wrlock(file_lock(file));
+    bool synced = enabled || sync_file_locked(file);
+    if (synced)
+    {
+        file->writeBack = enabled;
+        fserror = FS_NONE;
+    }
+    pthread_rwlock_unlock(file_lock(file));
+    return synced;
+}
 
-                free(currBuf);
+void close_file(File file)
+{  
+    if (file == NULL || !file->isOpen) {
+        fserror = FS_FILE_NOT_OPEN;
+        return;
+    }
+    // printf("CLOSING\n");
+    // the writer's changes go to disk, a reader has nothing to write.
+    // Nothing on disk records that the file was open
+    pthread_rwlock_t *lock = file_lock(file);
+    pthread_rwlock_wrlock(lock);
+    bool synced = file->fileMode != READ_WRITE || sync_file_locked(file);
+    close_inode(file->node, file->fileMode);
+    pthread_rwlock_unlock(lock);
+    file->isOpen = false;
+
+    fserror = synced ? FS_NONE : FS_IO_ERROR;
+    pthread_mutex_destroy(&file->lock);
+    free(file);
+}
 
-                positionInBlock = 0;
+// true if a read of numbytes at offset would see blocks that are still
+// in the write buffer
+bool read_overlaps_buffer(File file, uint64_t numbytes, uint64_t offset)
+{
+    OpenInode *node = file->node;
+    if (numbytes == 0 || node->bufferBlocks == 0 || offset >= (uint64_t)node->inode.size)
+    {
+        return false;
+    }
+    uint64_t last = offset + (numbytes < node->inode.size - offset ? numbytes : node->inode.size - offset) - 1;
+    return offset / SOFTWARE_DISK_BLOCK_SIZE < node->bufferStart + node->bufferBlocks &&
+           last / SOFTWARE_DISK_BLOCK_SIZE >= node->bufferStart;
+}
 
-                currIndirectBlock++;
-            }
+// takes the file's lock for reading, after flushing any buffered writes
+// a read of numbytes at offset would see. Flushing takes the file to
+// itself and the writer may buffer more in between, so check again.
+// Returns false without the lock if the flush failed
+bool lock_for_read(File file, uint64_t numbytes, uint64_t offset)
+{
+    pthread_rwlock_t *lock = file_lock(file);
+    pthread_rwlock_rdlock(lock);
+    while (read_overlaps_buffer(file, numbytes, offset))
+    {
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_wrlock(lock);
+        bool flushed = flush_write_buffer(file);
+        pthread_rwlock_unlock(lock);
+        if (!flushed)
+        {
+            return false;
         }
-        else
-        { // direct blocks
-            // READ WHAT IS IN FRONT STARTING AT POSITION IN BLOCK
-            // unsigned char *currBuf = malloc((SOFTWARE_DISK_BLOCK_SIZE - positionInBlock + 1) * sizeof(char));
-            // Software disk block size is 1024, so subtract the current position to get how many bytes you need to read total
-            //  Ex: if positionInBlock is 0 then we want to read SOFTWARE_DISK_BLOCK_SIZE size data, not positionInBlock size data
-            unsigned char *currBuf = read_data_from_disk((uint16_t)file->inode->blocks[currBlock], positionInBlock);
-            
-            // printf("READ FILE at block %d:  %s\n", currBlock, currBuf);
-
-
-            // for every iteration other than the first iteration the position is 0
-            if (currBuf == NULL)
+        pthread_rwlock_rdlock(lock);
+    }
+    return true;
+}
+
+// reads at offset without touching the handle, called with the file's
+// lock held for reading
+uint64_t read_file_range(File file, void *buf, uint64_t numbytes, uint64_t offset)
+{
+    fserror = FS_NONE;
+
+    // never read past the end of the file
+    uint64_t size = file->node->inode.size;
+    if (offset >= size)
+    {
+        numbytes = 0;
+    }
+    else if (numbytes > size - offset)
+    {
+        numbytes = size - offset;
+    }
+
+    // copy each block's bytes straight into the caller's buffer, works
+    // for any data including zero bytes. Whole blocks are read a run at a
+    // time, one disk read per extent
+    uint64_t bytesRead = 0;
+    while (bytesRead < numbytes)
+    {
+        uint32_t position = offset + bytesRead;
+        uint16_t positionInBlock = position % SOFTWARE_DISK_BLOCK_SIZE;
+        uint32_t runLength;
+        uint16_t blocknum = file_block_run(file, position / SOFTWARE_DISK_BLOCK_SIZE, &runLength);
+        if (blocknum == 0)
+        {
+            fserror = FS_IO_ERROR;
+            break;
+        }
+        uint64_t wholeBlocks = positionInBlock ? 0 : (numbytes - bytesRead) / SOFTWARE_DISK_BLOCK_SIZE;
+        if (wholeBlocks)
+        {
+            uint16_t count = wholeBlocks < runLength ? wholeBlocks : runLength;
+            if (!read_sd_blocks((unsigned char *)buf + bytesRead, blocknum, count))
             {
                 fserror = FS_IO_ERROR;
                 break;
             }
-            uint64_t currLength = strlen((const char *) currBuf);
-            int32_t bytesLeftToRead = numbytes - bytesRead;
-            // going to read more than the length of the file
-            if (bytesLeftToRead + (int32_t)file->filePosition > file->inode->size)
-            {
-                bytesLeftToRead = file->inode->size - file->filePosition;
-            }
-
-            if (currLength + bytesRead < numbytes)
-            { // not done reading numbytes
-
-                // reads the smaller amount of data
-                if (SOFTWARE_DISK_BLOCK_SIZE - positionInBlock < bytesLeftToRead)
-                {
-                    bytesLeftToRead = SOFTWARE_DISK_BLOCK_SIZE - positionInBlock;
-                    strncat((char *)tempBuf, (const char *) currBuf, bytesLeftToRead);
-                    bytesRead += bytesLeftToRead;
-                }
-                else
-                {
-                    // WE ARE DONE READING RAN OUT OF SPACE
-                    strncat((char *)tempBuf, (const char *) currBuf, bytesLeftToRead);
-                    bytesRead += bytesLeftToRead;
-                    break;
-                }
-            }
-            else
-            { // last read of numbytes
+            bytesRead += (uint64_t)count * SOFTWARE_DISK_BLOCK_SIZE;
+            continue;
+        }
 
-                // numbytes - bytesRead will never be greater than SOFTWARE_DISK_BLOCK_SIZE because of the previous if statement
-                if ((uint64_t)bytesLeftToRead > numbytes - bytesRead)
-                { // if the end of the file comes after how far I want to read
-                    bytesLeftToRead = numbytes - bytesRead;
-                }
-                strncat((char *)tempBuf, (const char *) currBuf, bytesLeftToRead);
-                bytesRead += bytesLeftToRead;
-            }
-            free(currBuf);
-            positionInBlock = 0;
+        unsigned char *block = pin_sd_block(blocknum);
+        if (block == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            break;
+        }
+        uint64_t bytesToRead = numbytes - bytesRead;
+        if (bytesToRead > (uint64_t)(SOFTWARE_DISK_BLOCK_SIZE - positionInBlock))
+        {
+            bytesToRead = SOFTWARE_DISK_BLOCK_SIZE - positionInBlock;
         }
-        currBlock++;
+        memcpy((unsigned char *)buf + bytesRead, block + positionInBlock, bytesToRead);
+        unpin_sd_block(blocknum);
+        bytesRead += bytesToRead;
+    }
+    return bytesRead;
+}
+
+uint64_t read_file(File file, void *buf, uint64_t numbytes)
+{
+    if (!file->isOpen)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+    pthread_mutex_lock(&file->lock);
+    if (!lock_for_read(file, numbytes, file->filePosition))
+    {
+        pthread_mutex_unlock(&file->lock);
+        return 0;
+    }
+    uint64_t size = file->node->inode.size;
+    if (numbytes && file->filePosition < size)
+    {
+        file_readahead(file, numbytes < size - file->filePosition ? numbytes : size - file->filePosition);
     }
+    uint64_t bytesRead = read_file_range(file, buf, numbytes, file->filePosition);
+    pthread_rwlock_unlock(file_lock(file));
     file->filePosition += bytesRead;
-    strcpy((char *)buf, (const char *)tempBuf);
-    free(tempBuf);
+    file->nextReadPosition = file->filePosition;
+    pthread_mutex_unlock(&file->lock);
+    return bytesRead;
+}
+
+uint64_t read_file_at(File file, void *buf, uint64_t numbytes, uint64_t offset)
+{
+    if (!file->isOpen)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+    if (!lock_for_read(file, numbytes, offset))
+    {
+        return 0;
+    }
+    uint64_t bytesRead = read_file_range(file, buf, numbytes, offset);
+    pthread_rwlock_unlock(file_lock(file));
     return bytesRead;
 }
 
@@ -710,98 +2334,171 @@ bool seek_file(File file, uint64_t bytepos)
 {
     uint16_t blockIndex = bytepos / SOFTWARE_DISK_BLOCK_SIZE;
 
-    if (blockIndex > MAX_DIRECT_BLOCK + MAX_INDIRECT_BLOCK || (uint64_t)file->inode->size < bytepos)
+    pthread_mutex_lock(&file->lock);
+    pthread_rwlock_rdlock(file_lock(file));
+    bool inRange = blockIndex <= MAX_FILE_BLOCKS && (uint64_t)file->node->inode.size >= bytepos;
+    pthread_rwlock_unlock(file_lock(file));
+    if (inRange)
     {
-        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
-        return false;
+        file->filePosition = bytepos;
     }
+    pthread_mutex_unlock(&file->lock);
 
-    file->filePosition = bytepos;
-    fserror = FS_NONE;
-    return true;
+    fserror = inRange ? FS_NONE : FS_EXCEEDS_MAX_FILE_SIZE;
+    return inRange;
 }
 
-bool delete_file(char *name)
+// removes a closed file, called with dirLock held for writing
+bool delete_file_locked(char *name)
 {
-
-    int16_t index = findDirEntry(name);
-    if (index == -1)
+    NameIndexEntry *index = findDirEntry(name);
+    if (index == NULL)
     {
         fserror = FS_FILE_NOT_FOUND;
         // printf("cant find file with the name: %s\n", name);
         return false;
     }
-    DirEntry *dirEntry;
-    void *data = read_from_disk(DIRECTORY_ENTRY, (uint16_t)index);
-    if (data == NULL)
+    journal_start(0);
+    unsigned char *block = journal_pin_block(index->dirEntryBlockNum);
+    uint16_t inodeNum = block ? ((DirEntry *)(block + index->dirEntryOffset))->inodeNum : 0;
+    if (block)
+    {
+        journal_unpin_block(index->dirEntryBlockNum, block);
+    }
+    journal_stop(0);
+    if (block == NULL)
     {
-        fserror = FS_IO_ERROR;
         return false;
     }
-    else
+
+    // no handle can open the file while the dir lock is held, but one
+    // may still be closing. An entry left by a close that couldn't sync
+    // is synced first, so the inode read below has all the file's blocks
+    pthread_rwlock_wrlock(&inodeLocks[inodeNum]);
+    OpenInode *node = openFiles[inodeNum];
+    if (node != NULL && !node->writer && !node->readers)
     {
-        dirEntry = (DirEntry *)data;
+        struct FileInternals handle = {.fileMode = READ_WRITE, .isOpen = true, .node = node};
+        if (sync_file_locked(&handle))
+        {
+            release_inode_if_idle(node);
+        }
     }
-    if (dirEntry->isFileOpen)
+    if (openFiles[inodeNum] != NULL)
     {
-        fserror = FS_FILE_OPEN;
+        pthread_rwlock_unlock(&inodeLocks[inodeNum]);
+        if (node->writer || node->readers)
+        {
+            fserror = FS_FILE_OPEN;
+        }
+        return false;
+    }
+    // the dir entry, inode and bitmaps are committed together
+    journal_start(JOURNAL_HANDLE_BLOCKS);
+    if (!dir_entry_remove(index->dirEntryBlockNum, index->dirEntryOffset))
+    {
+        journal_stop(JOURNAL_HANDLE_BLOCKS);
+        pthread_rwlock_unlock(&inodeLocks[inodeNum]);
         return false;
     }
-    clear_block((uint16_t)index);
-    clear_bit((uint16_t)index); // set bitmap
-    uint16_t inodeBlockNum = dirEntry->inodeBlockNum;
-    Inode *inode;
+    name_index_remove(name);
+
+    // copy out the block pointers, the inode is cleared below
+    Inode copy;
+    Inode *inode = &copy;
+    Inode cleared = {0};
+    bool freed = read_inode(inodeNum, inode) && free_file_blocks(inode) && write_inode(inodeNum, &cleared);
+    pthread_rwlock_unlock(&inodeLocks[inodeNum]);
+    if (freed)
+    {
+        release_inode(inodeNum); // set inode bitmap
 
-    data = read_from_disk(INODE, inodeBlockNum);
-    if (data == NULL)
+        // updates bitmaps
+        freed = write_bitmaps(true, true);
+    }
+    journal_stop(JOURNAL_HANDLE_BLOCKS);
+    if (!freed)
     {
-        fserror = FS_IO_ERROR;
         return false;
     }
-    else
+    fserror = FS_NONE;
+    return true;
+}
+
+bool delete_file(char *name)
+{
+    if (!mount_fs())
+    {
+        return false;
+    }
+    pthread_rwlock_wrlock(&dirLock);
+    bool deleted = delete_file_locked(name);
+    pthread_rwlock_unlock(&dirLock);
+    return deleted;
+}
+
+// starts writing at offset and overwrites, called with the file's lock
+// held for writing. offset is at most the file's size
+uint64_t write_file_range(File file, void *buf, uint64_t numbytes, uint32_t offset)
+{
+    fserror = FS_NONE;
+    uint64_t maxBytes = (uint64_t)MAX_FILE_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE;
+    bool tooBig = offset + numbytes > maxBytes;
+    if (tooBig)
     {
-        inode = (Inode *)data;
+        numbytes = offset < maxBytes ? maxBytes - offset : 0;
     }
-    for (uint16_t i = 0; i < 14; i++)
+    if (numbytes == 0)
     {
-        if (inode->blocks[i])
-        {
-            clear_block(inode->blocks[i]);
-            clear_bit(inode->blocks[i]); // set bitmap
-        }
+        fserror = tooBig ? FS_EXCEEDS_MAX_FILE_SIZE : FS_NONE;
+        return 0;
     }
-    if (inode->blocks[NUM_DIRECT_INODE_BLOCKS-1])
+
+    // small writes collect in the file's buffer, anything bigger goes
+    // straight to disk after whatever is buffered
+    uint64_t bytesWritten = 0;
+    bool allocated = false;
+    if (file->writeBack && numbytes < WRITE_BUFFER_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE)
     {
-        uint16_t *indirectBlocks = (uint16_t *)read_from_disk(BLOCKS, inode->blocks[NUM_DIRECT_INODE_BLOCKS-1]);
-        uint16_t i = 0;
-        while (indirectBlocks[i] != (uint16_t)0)
-        {
-            clear_block(indirectBlocks[i]);
-            clear_bit(indirectBlocks[i]); // set bitmap
-            i++;
-        }
-        clear_block(inode->blocks[NUM_DIRECT_INODE_BLOCKS-1]);
-        clear_bit(inode->blocks[NUM_DIRECT_INODE_BLOCKS-1]); // set bitmap
-        free(indirectBlocks);
+        bytesWritten = write_buffered(file, buf, numbytes, offset);
+    }
+    else if (flush_write_buffer(file))
+    {
+        // the size of the write is known, so allocate every block it
+        // needs up front. On a full disk this allocates what it can and
+        // the copy stops at the first missing block
+        reserve_file_blocks(file, (offset + numbytes - 1) / SOFTWARE_DISK_BLOCK_SIZE, &allocated);
+        bytesWritten = write_direct(file, buf, numbytes, offset);
+    }
+    if (tooBig && fserror == FS_NONE)
+    {
+        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
     }
-    clear_block(inodeBlockNum);
-    clear_bit(inodeBlockNum); // set bitmap
 
-    // updates bitmap
-    if (!write_sd_block(bitmap.map, 0))
+    // the bitmap and inode go to disk once per call, not once per block,
+    // or in write-back mode when the file is synced
+    if ((int32_t)(offset + bytesWritten) > file->node->inode.size)
+    {
+        file->node->inode.size = offset + bytesWritten;
+        file->node->inodeDirty = true;
+    }
+    if (allocated)
+    {
+        file->node->inodeDirty = true;
+        file->node->bitmapDirty = true;
+    }
+    if (!file->writeBack && !write_file_metadata(file))
     {
         fserror = FS_IO_ERROR;
-        return false;
     }
-    free(data);
-    return true;
+    // printf("END WRITE\n");
+    return bytesWritten;
 }
 
-// starts writing at the current position and overwrites
-uint64_t write_file(File file, void *buf, uint64_t numbytes) // I think we need to check bitmap and request space from the software disk and get that blocknum (pointer)
+uint64_t write_file(File file, void *buf, uint64_t numbytes)
 {
     // printf("WRITE\n");
-    if (!file->directoryEntry->isFileOpen)
+    if (!file->isOpen)
     {
         fserror = FS_FILE_NOT_OPEN;
         return 0;
@@ -811,201 +2508,61 @@ uint64_t write_file(File file, void *buf, uint64_t numbytes) // I think we need
         fserror = FS_FILE_READ_ONLY;
         return 0;
     }
+    pthread_mutex_lock(&file->lock);
+    pthread_rwlock_wrlock(file_lock(file));
+    uint64_t bytesWritten = write_file_range(file, buf, numbytes, file->filePosition);
+    pthread_rwlock_unlock(file_lock(file));
+    file->filePosition += bytesWritten;
+    pthread_mutex_unlock(&file->lock);
+    return bytesWritten;
+}
 
-    uint64_t bytesWritten = 0;
-
-    uint16_t blockIndex = file->filePosition / SOFTWARE_DISK_BLOCK_SIZE;
-    uint16_t positionInBlock = file->filePosition % SOFTWARE_DISK_BLOCK_SIZE;
-    uint16_t indirectBlockIndex = 0;
-    if (blockIndex > NUM_DIRECT_INODE_BLOCKS)
+uint64_t write_file_at(File file, void *buf, uint64_t numbytes, uint64_t offset)
+{
+    if (!file->isOpen)
     {
-        indirectBlockIndex = blockIndex - NUM_DIRECT_INODE_BLOCKS;
-        blockIndex = NUM_DIRECT_INODE_BLOCKS;
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
     }
-    uint16_t currBlock = blockIndex;
-
-    // 13 direct + 1 indirect block, so dont want to exceed. 0 is a not set block
-    while (currBlock <= NUM_DIRECT_INODE_BLOCKS && indirectBlockIndex < MAX_INDIRECT_BLOCK && bytesWritten <= numbytes)
+    if (file->fileMode != READ_WRITE)
     {
-        if (currBlock > NUM_DIRECT_INODE_BLOCKS) // at indirect block
-        {
-            uint16_t currIndirectBlock = indirectBlockIndex;
-            if (currIndirectBlock >= MAX_INDIRECT_BLOCK)
-            {
-                fserror = FS_EXCEEDS_MAX_FILE_SIZE;
-                break;
-            }
-            uint16_t *indirectBlocks = (uint16_t *)read_from_disk(BLOCKS, file->inode->blocks[NUM_DIRECT_INODE_BLOCKS]);
-
-            while (currIndirectBlock < MAX_INDIRECT_BLOCK)
-            {
-                if (indirectBlocks[currIndirectBlock] == 0)
-                {
-                    if (!read_sd_block(bitmap.map, 0))
-                    {
-                        fserror = FS_IO_ERROR;
-                        break;
-                    }
-                    int16_t blockNum = findFreeDataSpace();
-                    if (blockNum == -1)
-                    {
-                        fserror = FS_OUT_OF_SPACE;
-                        break;
-                    }
-                    set_bit((uint16_t)blockNum);
-                    if (!write_sd_block(bitmap.map, 0))
-                    {
-                        fserror = FS_IO_ERROR;
-                        break;
-                    }
-                    indirectBlocks[currIndirectBlock] = blockNum;
-                    if (!write_to_disk(file->inode, INODE, file->directoryEntry->inodeBlockNum))
-                    {
-                        fserror = FS_IO_ERROR;
-                        break;
-                    }
-                }
-                // unsigned char *currBuf = malloc(SOFTWARE_DISK_BLOCK_SIZE + 1);
-                unsigned char *currBuf = read_data_from_disk(file->inode->blocks[currBlock], 0);
-                if (currBuf == NULL)
-                {
-                    fserror = FS_IO_ERROR;
-                    break;
-                }
-                int16_t bytesToWrite = numbytes - bytesWritten;
-                int16_t remainingSpaceInBlock = SOFTWARE_DISK_BLOCK_SIZE - positionInBlock;
-
-                // need to figure out how many we can write to the file
-
-                // 2 options:
-                // we can fit the entire numbytes left in this block
-                if (bytesToWrite <= remainingSpaceInBlock)
-                {
-                    // fully writing then we're done
-                    strncpy((char *)currBuf + positionInBlock, buf, bytesToWrite);
-                    bytesWritten += bytesToWrite;
-                    if (!write_to_disk(currBuf, BLOCKS, file->inode->blocks[currBlock]))
-                    {
-                        fserror = FS_IO_ERROR;
-                        break;
-                    }
-                    positionInBlock = 0;
-                    break;
-                }
-                else
-                {
-                    // cant fit all lof buf in remaining space
-                    strncpy((char *)currBuf + positionInBlock, buf, remainingSpaceInBlock);
-                    bytesWritten += remainingSpaceInBlock;
-                    if (!write_to_disk(currBuf, BLOCKS, file->inode->blocks[currBlock]))
-                    {
-                        fserror = FS_IO_ERROR;
-                        break;
-                    }
-                    positionInBlock = 0;
-                }
-
-                positionInBlock = 0;
-
-                currIndirectBlock++;
-            }
-        }
-        else
-        { // direct blocks
-            // check if we need to allocate this block
-            if (file->inode->blocks[currBlock] == 0)
-            {
-                if (!read_sd_block(bitmap.map, 0))
-                {
-                    fserror = FS_IO_ERROR;
-                    break;
-                }
-                int16_t index = findFreeDataSpace();
-                if (index == -1)
-                {
-                    fserror = FS_OUT_OF_SPACE;
-                    break;
-                }
-                set_bit((uint16_t)index);
-                if (!write_sd_block(bitmap.map, 0))
-                {
-                    fserror = FS_IO_ERROR;
-                    break;
-                }
-                file->inode->blocks[currBlock] = index;
-                if (!write_to_disk(file->inode, INODE, file->directoryEntry->inodeBlockNum))
-                {
-                    fserror = FS_IO_ERROR;
-                    break;
-                }
-            }
-            // unsigned char *currBuf = malloc(SOFTWARE_DISK_BLOCK_SIZE + 1);
-            unsigned char *currBuf = read_data_from_disk(file->inode->blocks[currBlock], 0);
-            if (currBuf == NULL)
-            {
-                fserror = FS_IO_ERROR;
-                break;
-            }
-            int16_t bytesToWrite = numbytes - bytesWritten;
-            int16_t remainingSpaceInBlock = SOFTWARE_DISK_BLOCK_SIZE - positionInBlock;
-
-            // need to figure out how many we can write to the file
-
-            // 2 options:
-            // we can fit the entire numbytes left in this block
-            if (bytesToWrite <= remainingSpaceInBlock)
-            {
-                // fully writing then we're done
-
-                strncpy((char *)currBuf + positionInBlock, buf, bytesToWrite);
-                bytesWritten += bytesToWrite;
-                if (!write_to_disk(currBuf, BLOCKS, file->inode->blocks[currBlock]))
-                {
-                    fserror = FS_IO_ERROR;
-                    break;
-                }
-                positionInBlock = 0;
-                break;
-            }
-            else
-            {
-                // cant fit all lof buf in remaining space
-                strncpy((char *)currBuf + positionInBlock, buf, remainingSpaceInBlock);
-                bytesWritten += remainingSpaceInBlock;
-                if (!write_to_disk(currBuf, BLOCKS, file->inode->blocks[currBlock]))
-                {
-                    fserror = FS_IO_ERROR;
-                    break;
-                }
-            }
-        }
-        positionInBlock = 0;
-        currBlock++;
+        fserror = FS_FILE_READ_ONLY;
+        return 0;
+    }
+    // like seek_file, no writing past the end of the file
+    pthread_rwlock_wrlock(file_lock(file));
+    uint64_t bytesWritten = 0;
+    if (offset > (uint64_t)file->node->inode.size)
+    {
+        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
     }
-    file->filePosition = file->filePosition + bytesWritten;
-    if ((int32_t)file->filePosition > file->inode->size)
+    else
     {
-        file->inode->size = file->filePosition;
-        if (!write_to_disk(file->inode, INODE, file->directoryEntry->inodeBlockNum))
-        {
-            fserror = FS_IO_ERROR;
-        }
+        bytesWritten = write_file_range(file, buf, numbytes, (uint32_t)offset);
     }
-    // printf("END WRITE\n");
-    // printf("WRITE FILE name: %s", file->directoryEntry->name);
+    pthread_rwlock_unlock(file_lock(file));
     return bytesWritten;
 }
 
 uint64_t file_length(File file)
 {
     fserror = FS_NONE;
-    // printf("FileName: %s\n", file->directoryEntry->name);
-    return (uint64_t)file->inode->size;
+    pthread_rwlock_rdlock(file_lock(file));
+    uint64_t size = (uint64_t)file->node->inode.size;
+    pthread_rwlock_unlock(file_lock(file));
+    return size;
 }
 
 bool file_exists(char *name)
 {
-    if (findDirEntry(name) != -1)
+    if (!mount_fs())
+    {
+        return false;
+    }
+    pthread_rwlock_rdlock(&dirLock);
+    bool exists = findDirEntry(name) != NULL;
+    pthread_rwlock_unlock(&dirLock);
+    if (exists)
     {
         fserror = FS_NONE;
         return true;
@@ -1017,6 +2574,84 @@ bool file_exists(char *name)
     }
 }
 
+// ERROR RETURNING VARIANTS:
+// fserror is per thread, so each of these just hands back what the call
+// set it to
+
+FSError fs_open(char *name, FileMode mode, File *file)
+{
+    *file = open_file(name, mode);
+    return fserror;
+}
+
+FSError fs_create(char *name, File *file)
+{
+    *file = create_file(name);
+    return fserror;
+}
+
+FSError fs_close(File file)
+{
+    close_file(file);
+    return fserror;
+}
+
+FSError fs_read(File file, void *buf, uint64_t numbytes, uint64_t *bytesRead)
+{
+    *bytesRead = read_file(file, buf, numbytes);
+    return fserror;
+}
+
+FSError fs_write(File file, void *buf, uint64_t numbytes, uint64_t *bytesWritten)
+{
+    *bytesWritten = write_file(file, buf, numbytes);
+    return fserror;
+}
+
+FSError fs_read_at(File file, void *buf, uint64_t numbytes, uint64_t offset, uint64_t *bytesRead)
+{
+    *bytesRead = read_file_at(file, buf, numbytes, offset);
+    return fserror;
+}
+
+FSError fs_write_at(File file, void *buf, uint64_t numbytes, uint64_t offset, uint64_t *bytesWritten)
+{
+    *bytesWritten = write_file_at(file, buf, numbytes, offset);
+    return fserror;
+}
+
+FSError fs_seek(File file, uint64_t bytepos)
+{
+    seek_file(file, bytepos);
+    return fserror;
+}
+
+FSError fs_length(File file, uint64_t *length)
+{
+    *length = file_length(file);
+    return fserror;
+}
+
+FSError fs_delete(char *name)
+{
+    delete_file(name);
+    return fserror;
+}
+
+// writes out every open file and makes it all durable
+FSError fs_sync(void)
+{
+    sync_all_files();
+    return fserror;
+}
+
+// file_exists reports a missing file as an error, here it's just false
+FSError fs_exists(char *name, bool *exists)
+{
+    *exists = file_exists(name);
+    return *exists || fserror == FS_FILE_ALREADY_EXISTS ? FS_NONE : fserror;
+}
+
 void fs_print_error(void)
 {
     switch (fserror)
@@ -1031,7 +2666,7 @@ void fs_print_error(void)
         fprintf(stderr, "Error: Attempted read/write/close/etc. on a file that isn't open.\n");
         break;
     case FS_FILE_OPEN:
-        fprintf(stderr, "Error: File is already open. Concurrent opens are not supported, and neither is deleting an open file.\n");
+        fprintf(stderr, "Error: File is already open. Only one READ_WRITE open is supported, and deleting an open file is not.\n");
         break;
     case FS_FILE_NOT_FOUND:
         fprintf(stderr, "Error: Attempted open or delete of a file that doesn’t exist.\n");
@@ -1060,16 +2695,23 @@ void fs_print_error(void)
 bool check_structure_alignment(void)
 {
     printf("Expecting sizeof(Inode) = 32, actual = %lu\n", sizeof(Inode));
-    printf("Expecting sizeof(IndirectBlock) = %d, actual = %lu\n", SOFTWARE_DISK_BLOCK_SIZE, sizeof(IndirectBlock));
+    printf("Expecting sizeof(ExtentBlock) = %d, actual = %lu\n", SOFTWARE_DISK_BLOCK_SIZE, sizeof(ExtentBlock));
     printf("Expecting sizeof(InodeBlock) = %d, actual = %lu\n", SOFTWARE_DISK_BLOCK_SIZE, sizeof(InodeBlock));
-    printf("Expecting sizeof(DirEntry) = %d, actual = %lu\n", SOFTWARE_DISK_BLOCK_SIZE, sizeof(DirEntry));
+    printf("Expecting sizeof(DirEntry) = 8, actual = %lu\n", sizeof(DirEntry));
+    printf("Expecting DIR_RECORD_SIZE(%d) <= %d, actual = %lu\n", MAX_FILE_NAME_SIZE, SOFTWARE_DISK_BLOCK_SIZE, DIR_RECORD_SIZE(MAX_FILE_NAME_SIZE));
+    printf("Expecting room for %d max length dir records, actual = %lu\n", MAX_NUMBER_OF_FILES,
+           DIR_ENTRY_NUM_BLOCKS * (SOFTWARE_DISK_BLOCK_SIZE / DIR_RECORD_SIZE(MAX_FILE_NAME_SIZE)));
     printf("Expecting sizeof(FreeBitmap) = %d, actual = %lu\n", SOFTWARE_DISK_BLOCK_SIZE, sizeof(FreeBitmap));
+    printf("Expecting sizeof(JournalHeader) <= %d, actual = %lu\n", SOFTWARE_DISK_BLOCK_SIZE, sizeof(JournalHeader));
 
     if (sizeof(Inode) != 32 ||
-        sizeof(IndirectBlock) != SOFTWARE_DISK_BLOCK_SIZE ||
+        sizeof(ExtentBlock) != SOFTWARE_DISK_BLOCK_SIZE ||
         sizeof(InodeBlock) != SOFTWARE_DISK_BLOCK_SIZE ||
-        sizeof(DirEntry) != SOFTWARE_DISK_BLOCK_SIZE ||
-        sizeof(FreeBitmap) != SOFTWARE_DISK_BLOCK_SIZE)
+        sizeof(DirEntry) != 8 ||
+        DIR_RECORD_SIZE(MAX_FILE_NAME_SIZE) > SOFTWARE_DISK_BLOCK_SIZE ||
+        DIR_ENTRY_NUM_BLOCKS * (SOFTWARE_DISK_BLOCK_SIZE / DIR_RECORD_SIZE(MAX_FILE_NAME_SIZE)) < MAX_NUMBER_OF_FILES ||
+        sizeof(FreeBitmap) != SOFTWARE_DISK_BLOCK_SIZE ||
+        sizeof(JournalHeader) > SOFTWARE_DISK_BLOCK_SIZE)
     {
         return false;
     }
@@ -31,8 +31,9 @@ typedef enum  {
   FS_NONE, 
   FS_OUT_OF_SPACE,         // the operation caused the software disk to fill up
   FS_FILE_NOT_OPEN,  	   // attempted read/write/close/etc. on file that isn't open
-  FS_FILE_OPEN,      	   // file is already open. Concurrent opens are not
-                           // supported and neither is deleting a file that is open.
+  FS_FILE_OPEN,      	   // file is already open READ_WRITE. Any number of READ_ONLY
+                           // opens plus one READ_WRITE open are supported, deleting
+                           // a file that is open is not.
   FS_FILE_NOT_FOUND, 	   // attempted open or delete of file that doesn’t exist
   FS_FILE_READ_ONLY, 	   // attempted write to file opened for READ_ONLY
   FS_FILE_ALREADY_EXISTS,  // attempted creation of file with existing name
@@ -44,8 +45,10 @@ typedef enum  {
 // function prototypes for filesystem API
 
 // open existing file with pathname 'name' and access mode 'mode'.
-// Current file position is set to byte 0.  Returns NULL on
-// error. Always sets 'fserror' global.
+// A file can be open through any number of READ_ONLY handles and one
+// READ_WRITE handle at a time; each handle has its own file position
+// and all of them see the writer's data.  Current file position is
+// set to byte 0.  Returns NULL on error. Always sets 'fserror' global.
 File open_file(char *name, FileMode mode);
 
 // create and open new file with pathname 'name' and (implied) access
@@ -53,7 +56,10 @@ File open_file(char *name, FileMode mode);
 // NULL on error. Always sets 'fserror' global.
 File create_file(char *name);
 
-// close 'file'.  Always sets 'fserror' global.
+// close 'file', writing out what it holds in memory.  If that fails,
+// the data stays in memory and sync_all_files() tries again.  The file
+// is not durable until sync_file() or sync_all_files().  Always sets
+// 'fserror' global.
 void close_file(File file);
 
 // read at most 'numbytes' of data from 'file' into 'buf', starting at
@@ -68,6 +74,20 @@ uint64_t read_file(File file, void *buf, uint64_t numbytes);
 // 'fserror' global.
 uint64_t write_file(File file, void *buf, uint64_t numbytes);
 
+// read at most 'numbytes' of data from 'file' into 'buf', starting at
+// byte 'offset'.  The current file position is neither used nor
+// changed, so several threads can read through the same handle at
+// once.  Returns the number of bytes read, less than 'numbytes' at end
+// of file.  Always sets 'fserror' global.
+uint64_t read_file_at(File file, void *buf, uint64_t numbytes, uint64_t offset);
+
+// write 'numbytes' of data from 'buf' into 'file' at byte 'offset',
+// which can be at most the current length of the file.  The current
+// file position is neither used nor changed, so several threads can
+// write through the same handle at once.  Returns the number of bytes
+// written.  Always sets 'fserror' global.
+uint64_t write_file_at(File file, void *buf, uint64_t numbytes, uint64_t offset);
+
 // sets current position in file to 'bytepos', always relative to the
 // beginning of file.  Seeks past the current end of file should
 // extend the file. Returns true on success and false on failure.
@@ -78,6 +98,24 @@ bool seek_file(File file, uint64_t bytepos);
 // 'fserror' global.
 uint64_t file_length(File file);
 
+// writes any data and inode changes 'file' is holding in memory in
+// write-back mode to the software disk, then makes everything written
+// to the filesystem so far durable.  Threads syncing at the same time
+// share one journal commit.  Returns true on success and false on
+// failure.  Always sets 'fserror' global.
+bool sync_file(File file);
+
+// same as sync_file() for every open file at once.  Returns true on
+// success and false on failure.  Always sets 'fserror' global.
+bool sync_all_files(void);
+
+// turns write-back buffering of small writes to 'file' on or off.
+// Files start out with it on; buffered data is written by close_file(),
+// sync_file(), when the file's buffer fills or when the program exits.
+// Turning it off syncs the file.  Returns true on success and false on failure.  Always
+// sets 'fserror' global.
+bool set_file_write_back(File file, bool enabled);
+
 // deletes the file named 'name', if it exists. Returns true on
 // success, false on failure.  Always sets 'fserror' global.
 bool delete_file(char *name); 
@@ -86,6 +124,22 @@ bool delete_file(char *name);
 // exists, otherwise false.  Always sets 'fserror' global.
 bool file_exists(char *name);
 
+// variants of the calls above that return the error code directly,
+// FS_NONE on success, and hand back their result through the last
+// argument, so callers don't have to read 'fserror' after each call.
+FSError fs_open(char *name, FileMode mode, File *file);
+FSError fs_create(char *name, File *file);
+FSError fs_close(File file);
+FSError fs_read(File file, void *buf, uint64_t numbytes, uint64_t *bytesRead);
+FSError fs_write(File file, void *buf, uint64_t numbytes, uint64_t *bytesWritten);
+FSError fs_read_at(File file, void *buf, uint64_t numbytes, uint64_t offset, uint64_t *bytesRead);
+FSError fs_write_at(File file, void *buf, uint64_t numbytes, uint64_t offset, uint64_t *bytesWritten);
+FSError fs_seek(File file, uint64_t bytepos);
+FSError fs_length(File file, uint64_t *length);
+FSError fs_delete(char *name);
+FSError fs_sync(void);
+FSError fs_exists(char *name, bool *exists);
+
 // describe current filesystem error code by printing a descriptive
 // message to standard error.
 void fs_print_error(void);
@@ -95,7 +149,8 @@ void fs_print_error(void);
 // success, false on failure.
 bool check_structure_alignment(void);
 
-// filesystem error code set (set by each filesystem function)
-extern FSError fserror;
+// filesystem error code set (set by each filesystem function).  Each
+// thread has its own, describing the last call that thread made.
+extern _Thread_local FSError fserror;
 
 #endif
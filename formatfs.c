@@ -19,6 +19,9 @@ void set_jth_bit(uint64_t j)
 
 void formatfs(void)
 {
+    // the new disk reads back as zeros, which is already an empty file
+    // system: no inodes or dir entries in use and nothing in the
+    // journal. Only the bitmap block has to be written
     init_software_disk();
 
     memset(bitmap.map, 0, SOFTWARE_DISK_BLOCK_SIZE);
@@ -3,53 +3,385 @@
 // (@nolaforensix).
 //
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "softwaredisk.h"
 
 #define NUM_BLOCKS 8192
 #define BACKING_STORE "sdprivate.sd"
+#define DISK_BYTES ((size_t)NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE)
+#define DEFAULT_CACHE_BLOCKS 64
+#define MAX_RUN_BLOCKS 64 // blocks per preadv/pwritev, well under IOV_MAX
 
 // internals of software disk implementation
 typedef struct SoftwareDiskInternals {
-  FILE *fp;       
+  SDBackend backend;  // access method for the backing store
+  FILE *fp;           // open backing store for SD_BACKEND_STDIO
+  off_t fp_offset;    // where the last stdio transfer left 'fp', -1 if unknown
+  bool fp_writing;    // ... and whether it was a write
+  int fd;             // open backing store for SD_BACKEND_PREAD/MMAP
+  unsigned char *map; // whole backing store for SD_BACKEND_MMAP
 } SoftwareDiskInternals;
 
+// one block held in the block cache.  'data' comes first so that
+// structures parsed in place through a pin are suitably aligned.
+typedef struct CacheFrame {
+  unsigned char data[SOFTWARE_DISK_BLOCK_SIZE];
+  uint16_t blocknum;
+  uint16_t pins;      // pinned frames are never evicted
+  bool valid;         // frame holds 'blocknum'
+  bool dirty;         // modified since it was read, written back on eviction
+  bool referenced;    // CLOCK reference bit
+} CacheFrame;
+
+// write-back block cache between the block API and the stdio/pread
+// backends, with CLOCK eviction.  SD_BACKEND_MMAP bypasses it since
+// the mapping already serves blocks from memory.
+typedef struct BlockCache {
+  CacheFrame *frames;
+  uint32_t num_frames;
+  uint32_t hand;                // next frame the CLOCK hand inspects
+  int32_t frame_of[NUM_BLOCKS]; // frame holding each block, or -1
+  SDCacheStats stats;
+} BlockCache;
+
 //
 // GLOBALS
 //
 
-static SoftwareDiskInternals sd;
+static SoftwareDiskInternals sd = { SD_BACKEND_STDIO, NULL, -1, false, -1, NULL };
 
-// software disk error code set (set by each software disk function).
-SDError sderror;
+static BlockCache cache = { NULL, DEFAULT_CACHE_BLOCKS };
 
+// serializes every public entry point, so the cache, the backend and
+// the stdio seek position are only touched by one thread at a time.
+// Held only for the duration of a call, never across pin/unpin.
+static pthread_mutex_t sd_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// initializes the software disk to all zeros, destroying any existing
-// data.  Returns true on success, otherwise false. Always sets global
-// 'sderror'.
-bool init_software_disk(void) {
-  
-  uint16_t i;
-  char block[SOFTWARE_DISK_BLOCK_SIZE];
-  sderror = SD_NONE;
-  unlink(BACKING_STORE);
-  sd.fp = fopen(BACKING_STORE, "w+");
-  if (! sd.fp) {
+// software disk error code set (set by each software disk function),
+// one per thread.
+_Thread_local SDError sderror;
+
+// returns true if the backing store is open with the current backend
+static bool sd_is_open(void) {
+
+  switch (sd.backend) {
+  case SD_BACKEND_PREAD:
+    return sd.fd >= 0;
+  case SD_BACKEND_MMAP:
+    return sd.map != NULL;
+  default:
+    return sd.fp != NULL;
+  }
+}
+
+static bool cache_flush(void);
+
+// closes the backing store, whichever backend opened it, after writing
+// back dirty cached blocks
+static void sd_close(void) {
+
+  if (sd_is_open()) {
+    cache_flush();
+  }
+  if (sd.map) {
+    munmap(sd.map, DISK_BYTES);
+    sd.map = NULL;
+  }
+  if (sd.fp) {
+    fclose(sd.fp);
+    sd.fp = NULL;
+    sd.fp_offset = -1;
+  }
+  if (sd.fd >= 0) {
+    close(sd.fd);
+    sd.fd = -1;
+  }
+}
+
+// maps the already open backing store for SD_BACKEND_MMAP.  Sets
+// 'sderror' and returns false on failure.
+static bool sd_map(void) {
+
+  void *map = mmap(NULL, DISK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, sd.fd, 0);
+  if (map == MAP_FAILED) {
+    sd_close();
     sderror = SD_INTERNAL_ERROR;
     return false;
   }
-  
-  bzero(block, SOFTWARE_DISK_BLOCK_SIZE);
-  for (i = 0; i < NUM_BLOCKS; i++) {
-    if (fwrite(block, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
-      fclose(sd.fp);
-      sd.fp = NULL;
+  sd.map = map;
+  return true;
+}
+
+// opens an existing backing store with the current backend and checks
+// that it has the size of an initialized software disk.  Sets
+// 'sderror' and returns false on failure.
+static bool sd_open(void) {
+
+  struct stat st;
+
+  if (sd_is_open()) {
+    return true;
+  }
+
+  switch (sd.backend) {
+  case SD_BACKEND_PREAD:
+  case SD_BACKEND_MMAP:
+    sd.fd = open(BACKING_STORE, O_RDWR);
+    if (sd.fd < 0) {
       sderror = SD_INTERNAL_ERROR;
       return false;
     }
+    if (fstat(sd.fd, &st) || st.st_size != (off_t)DISK_BYTES) {
+      sd_close();
+      sderror = SD_NOT_INIT;
+      return false;
+    }
+    return sd.backend == SD_BACKEND_MMAP ? sd_map() : true;
+  default:
+    sd.fp = fopen(BACKING_STORE, "r+");
+    if (! sd.fp) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    fseek(sd.fp, 0L, SEEK_END);
+    if (ftell(sd.fp) != DISK_BYTES) {
+      sd_close();
+      sderror = SD_NOT_INIT;
+      return false;
+    }
+    sd.fp_offset = -1;
+    return true;
+  }
+}
+
+static bool sd_backend_read(void *buf, uint16_t blocknum);
+static bool sd_backend_write(void *buf, uint16_t blocknum);
+
+// writes back dirty cached blocks when the program exits, since nothing
+// else tells the software disk that a filesystem user is done with it
+static void cache_exit(void) {
+
+  pthread_mutex_lock(&sd_lock);
+  if (sd_is_open()) {
+    cache_flush();
+  }
+  pthread_mutex_unlock(&sd_lock);
+}
+
+// allocates the cache frames on first use.  Returns false if out of
+// memory.
+static bool cache_setup(void) {
+
+  static bool registered;
+  uint32_t i;
+
+  if (cache.frames) {
+    return true;
+  }
+  cache.frames = calloc(cache.num_frames, sizeof(CacheFrame));
+  if (! cache.frames) {
+    return false;
+  }
+  for (i = 0; i < NUM_BLOCKS; i++) {
+    cache.frame_of[i] = -1;
+  }
+  cache.hand = 0;
+  if (! registered) {
+    atexit(cache_exit);
+    registered = true;
+  }
+  return true;
+}
+
+// returns the frame caching 'blocknum', or NULL
+static CacheFrame *cache_lookup(uint16_t blocknum) {
+
+  if (! cache.frames || cache.frame_of[blocknum] < 0) {
+    return NULL;
+  }
+  return &cache.frames[cache.frame_of[blocknum]];
+}
+
+// writes a dirty frame back to the backing store
+static bool cache_writeback(CacheFrame *f) {
+
+  if (! sd_backend_write(f->data, f->blocknum)) {
+    return false;
+  }
+  f->dirty = false;
+  cache.stats.writebacks++;
+  return true;
+}
+
+// picks an unpinned frame with the CLOCK algorithm, writing back and
+// evicting its block.  '*victim' is NULL if every frame is pinned.
+// Returns false on an I/O error.
+static bool cache_evict(CacheFrame **victim) {
+
+  CacheFrame *f;
+  uint32_t i;
+
+  *victim = NULL;
+  // two sweeps: the first may only clear reference bits
+  for (i = 0; i < 2 * cache.num_frames; i++) {
+    f = &cache.frames[cache.hand];
+    cache.hand = (cache.hand + 1) % cache.num_frames;
+    if (f->pins) {
+      continue;
+    }
+    if (f->valid && f->referenced) {
+      f->referenced = false;
+      continue;
+    }
+    if (f->valid) {
+      if (f->dirty && ! cache_writeback(f)) {
+	return false;
+      }
+      cache.frame_of[f->blocknum] = -1;
+      f->valid = false;
+      cache.stats.evictions++;
+    }
+    *victim = f;
+    return true;
+  }
+  return true;
+}
+
+// finds or allocates the frame for 'blocknum', reading the block from
+// the backing store on a miss if 'load' is set.  '*frame' is NULL if
+// every frame is pinned.  Returns false on an I/O error.
+static bool cache_get(uint16_t blocknum, bool load, CacheFrame **frame) {
+
+  CacheFrame *f;
+
+  *frame = NULL;
+  if (! cache_setup()) {
+    sderror = SD_INTERNAL_ERROR;
+    return false;
+  }
+  if ((f = cache_lookup(blocknum))) {
+    cache.stats.hits++;
+    f->referenced = true;
+    *frame = f;
+    return true;
+  }
+
+  cache.stats.misses++;
+  if (! cache_evict(&f)) {
+    return false;
+  }
+  if (! f) {
+    return true;
+  }
+  if (load && ! sd_backend_read(f->data, blocknum)) {
+    return false;
+  }
+  f->blocknum = blocknum;
+  f->valid = true;
+  f->dirty = false;
+  f->referenced = true;
+  cache.frame_of[blocknum] = f - cache.frames;
+  *frame = f;
+  return true;
+}
+
+// writes back every dirty cached block.  Returns false on an I/O error.
+static bool cache_flush(void) {
+
+  uint32_t i;
+
+  if (! cache.frames) {
+    return true;
+  }
+  for (i = 0; i < cache.num_frames; i++) {
+    if (cache.frames[i].valid && cache.frames[i].dirty &&
+	! cache_writeback(&cache.frames[i])) {
+      return false;
+    }
   }
   return true;
 }
 
+// discards all cached blocks without writing them back
+static void cache_drop(void) {
+
+  free(cache.frames);
+  cache.frames = NULL;
+}
+
+// initializes the software disk to all zeros, destroying any existing
+// data.  The backing store is created empty and extended to full size
+// with ftruncate, so the blocks are holes that read back as zeros and
+// only take space once written, and formatting takes the same time for
+// any disk size.  Returns true on success, otherwise false. Always sets
+// global 'sderror'.
+static bool sd_init(void) {
+
+  sderror = SD_NONE;
+  cache_drop();
+  sd_close();
+  unlink(BACKING_STORE);
+
+  switch (sd.backend) {
+  case SD_BACKEND_PREAD:
+  case SD_BACKEND_MMAP:
+    sd.fd = open(BACKING_STORE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sd.fd < 0) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    if (ftruncate(sd.fd, (off_t)DISK_BYTES)) {
+      sd_close();
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    return sd.backend == SD_BACKEND_MMAP ? sd_map() : true;
+  default:
+    sd.fp = fopen(BACKING_STORE, "w+");
+    if (! sd.fp) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    if (ftruncate(fileno(sd.fp), (off_t)DISK_BYTES)) {
+      sd_close();
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    sd.fp_offset = -1;
+    return true;
+  }
+}
+
+// selects 'backend' for accessing an already initialized software
+// disk, closing the backing store if it is currently open.  The next
+// block read or write reopens it with the new backend.  The block
+// cache is written back and emptied on a change, since writes made
+// through the mapping bypass it.  Must not be called while blocks are
+// pinned.
+static void sd_set_backend(SDBackend backend) {
+
+  sd_close();
+  if (backend != sd.backend) {
+    cache_drop();
+  }
+  sd.backend = backend;
+}
+
+// returns the backend currently selected for the software disk
+SDBackend software_disk_backend(void) {
+
+  SDBackend backend;
+
+  pthread_mutex_lock(&sd_lock);
+  backend = sd.backend;
+  pthread_mutex_unlock(&sd_lock);
+  return backend;
+}
+
 // returns the size of the SoftwareDisk in multiples of
 // SOFTWARE_DISK_BLOCK_SIZE
 uint16_t software_disk_size() {
@@ -57,28 +389,324 @@ uint16_t software_disk_size() {
   return NUM_BLOCKS;
 }
 
-// writes a block of data from 'buf' at location 'blocknum'.  Blocks
-// are numbered from 0.  The buffer 'buf' must be of size
-// SOFTWARE_DISK_BLOCK_SIZE.  Returns true on success or false on
-// failure.  Always sets global 'sderror'.
-bool write_sd_block(void *buf, uint16_t blocknum) {
+// positions the stdio stream for a transfer at 'offset'.  The fseek
+// is skipped when the last transfer in the same direction ended there,
+// so sequential blocks collect in the stdio buffer; C needs a seek
+// between a read and a write anyway.  Nothing is flushed per block,
+// durability is up to sd_sync().
+static void sd_stdio_seek(off_t offset, bool write) {
 
-  sderror = SD_NONE;
-  if (! sd.fp) {
-    sd.fp = fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
+  if (offset != sd.fp_offset || write != sd.fp_writing) {
+    fseek(sd.fp, offset, SEEK_SET);
+  }
+  sd.fp_offset = -1;
+  sd.fp_writing = write;
+}
+
+// writes one block to the backing store with the current backend.
+// The disk must be open and 'blocknum' valid.
+static bool sd_backend_write(void *buf, uint16_t blocknum) {
+
+  switch (sd.backend) {
+  case SD_BACKEND_PREAD:
+    if (pwrite(sd.fd, buf, SOFTWARE_DISK_BLOCK_SIZE,
+	       (off_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE) != SOFTWARE_DISK_BLOCK_SIZE) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    return true;
+  case SD_BACKEND_MMAP:
+    memcpy(sd.map + (size_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE, buf, SOFTWARE_DISK_BLOCK_SIZE);
+    return true;
+  default:
+    sd_stdio_seek((off_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE, true);
+    if (fwrite(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    sd.fp_offset = (off_t)(blocknum + 1) * SOFTWARE_DISK_BLOCK_SIZE;
+    return true;
+  }
+}
+
+// reads one block from the backing store with the current backend.
+// The disk must be open and 'blocknum' valid.
+static bool sd_backend_read(void *buf, uint16_t blocknum) {
+
+  switch (sd.backend) {
+  case SD_BACKEND_PREAD:
+    if (pread(sd.fd, buf, SOFTWARE_DISK_BLOCK_SIZE,
+	      (off_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE) != SOFTWARE_DISK_BLOCK_SIZE) {
       sderror = SD_INTERNAL_ERROR;
       return false;
     }
-    else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp = NULL;
-	sderror=SD_NOT_INIT;
+    return true;
+  case SD_BACKEND_MMAP:
+    memcpy(buf, sd.map + (size_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE, SOFTWARE_DISK_BLOCK_SIZE);
+    return true;
+  default:
+    sd_stdio_seek((off_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE, false);
+    if (fread(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    sd.fp_offset = (off_t)(blocknum + 1) * SOFTWARE_DISK_BLOCK_SIZE;
+    return true;
+  }
+}
+
+// reads or writes 'n' consecutive blocks starting at 'blocknum' with
+// the current backend, one buffer per block.  The disk must be open
+// and the blocks valid.
+static bool sd_backend_transfer(struct iovec *iov, int n, uint16_t blocknum, bool write) {
+
+  ssize_t bytes = (ssize_t)n * SOFTWARE_DISK_BLOCK_SIZE;
+  off_t offset = (off_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE;
+  int i;
+
+  switch (sd.backend) {
+  case SD_BACKEND_PREAD:
+    if ((write ? pwritev(sd.fd, iov, n, offset) : preadv(sd.fd, iov, n, offset)) != bytes) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    return true;
+  case SD_BACKEND_MMAP:
+    for (i = 0; i < n; i++, offset += SOFTWARE_DISK_BLOCK_SIZE) {
+      if (write) {
+	memcpy(sd.map + offset, iov[i].iov_base, SOFTWARE_DISK_BLOCK_SIZE);
+      }
+      else {
+	memcpy(iov[i].iov_base, sd.map + offset, SOFTWARE_DISK_BLOCK_SIZE);
+      }
+    }
+    return true;
+  default:
+    sd_stdio_seek(offset, write);
+    for (i = 0; i < n; i++) {
+      if ((write ? fwrite(iov[i].iov_base, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp)
+	   : fread(iov[i].iov_base, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp)) != 1) {
+	sderror = SD_INTERNAL_ERROR;
 	return false;
       }
     }
+    sd.fp_offset = offset + bytes;
+    return true;
+  }
+}
+
+// transfers the 'count' blocks in 'vec'.  Cached blocks are copied
+// from or into their frame, runs of consecutive uncached blocks go to
+// the backend together.  Uncached blocks are not brought into the
+// cache, so a large transfer doesn't evict everything else.
+static bool sd_transfer(SDBlockVec *vec, uint32_t count, bool write) {
+
+  struct iovec iov[MAX_RUN_BLOCKS];
+  CacheFrame *f;
+  uint32_t i, n;
+
+  sderror = SD_NONE;
+  if (! sd_open()) {
+    return false;
+  }
+  for (i = 0; i < count; i++) {
+    if (vec[i].blocknum > NUM_BLOCKS - 1) {
+      sderror = SD_ILLEGAL_BLOCK_NUMBER;
+      return false;
+    }
+  }
+
+  i = 0;
+  while (i < count) {
+    if (sd.backend != SD_BACKEND_MMAP && (f = cache_lookup(vec[i].blocknum))) {
+      cache.stats.hits++;
+      f->referenced = true;
+      if (write) {
+	memcpy(f->data, vec[i].buf, SOFTWARE_DISK_BLOCK_SIZE);
+	f->dirty = true;
+      }
+      else {
+	memcpy(vec[i].buf, f->data, SOFTWARE_DISK_BLOCK_SIZE);
+      }
+      i++;
+      continue;
+    }
+
+    n = 0;
+    do {
+      iov[n].iov_base = vec[i + n].buf;
+      iov[n].iov_len = SOFTWARE_DISK_BLOCK_SIZE;
+      n++;
+    } while (i + n < count && n < MAX_RUN_BLOCKS &&
+	     vec[i + n].blocknum == vec[i].blocknum + n &&
+	     (sd.backend == SD_BACKEND_MMAP || ! cache_lookup(vec[i + n].blocknum)));
+    if (! sd_backend_transfer(iov, n, vec[i].blocknum, write)) {
+      return false;
+    }
+    i += n;
+  }
+  return true;
+}
+
+// transfers 'count' consecutive blocks from 'blocknum' to or from the
+// contiguous buffer 'buf', MAX_RUN_BLOCKS at a time
+static bool sd_transfer_run(void *buf, uint16_t blocknum, uint16_t count, bool write) {
+
+  SDBlockVec vec[MAX_RUN_BLOCKS];
+  uint32_t done, n, i;
+
+  if ((uint32_t)blocknum + count > NUM_BLOCKS) {
+    sderror = SD_ILLEGAL_BLOCK_NUMBER;
+    return false;
+  }
+  for (done = 0; done < count; done += n) {
+    n = count - done < MAX_RUN_BLOCKS ? count - done : MAX_RUN_BLOCKS;
+    for (i = 0; i < n; i++) {
+      vec[i].blocknum = blocknum + done + i;
+      vec[i].buf = (unsigned char *)buf + (size_t)(done + i) * SOFTWARE_DISK_BLOCK_SIZE;
+    }
+    if (! sd_transfer(vec, n, write)) {
+      return false;
+    }
+  }
+  sderror = SD_NONE;
+  return true;
+}
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf'.
+// Returns true on success or false on failure.  Always sets global
+// 'sderror'.
+bool read_sd_blocks(void *buf, uint16_t blocknum, uint16_t count) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_transfer_run(buf, blocknum, count, false);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf'.
+// Returns true on success or false on failure.  Always sets global
+// 'sderror'.
+bool write_sd_blocks(void *buf, uint16_t blocknum, uint16_t count) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_transfer_run(buf, blocknum, count, true);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+// reads the blocks of a scatter list.  Returns true on success or
+// false on failure.  Always sets global 'sderror'.
+bool read_sd_blockv(SDBlockVec *vec, uint32_t count) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_transfer(vec, count, false);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+// writes the blocks of a scatter list.  Returns true on success or
+// false on failure.  Always sets global 'sderror'.
+bool write_sd_blockv(SDBlockVec *vec, uint32_t count) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_transfer(vec, count, true);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+// reads up to 'count' consecutive blocks starting at 'blocknum' into
+// the block cache ahead of use.  Returns true on success or false on
+// failure.  Always sets global 'sderror'.
+static bool sd_prefetch(uint16_t blocknum, uint16_t count) {
+
+  CacheFrame *run[MAX_RUN_BLOCKS];
+  struct iovec iov[MAX_RUN_BLOCKS];
+  uint32_t i, j, n, budget;
+  bool ok;
+
+  sderror = SD_NONE;
+  if (! sd_open()) {
+    return false;
+  }
+  if (sd.backend == SD_BACKEND_MMAP) {
+    return true;
+  }
+  if ((uint32_t)blocknum + count > NUM_BLOCKS) {
+    count = NUM_BLOCKS - blocknum;
+  }
+  if (! cache_setup()) {
+    sderror = SD_INTERNAL_ERROR;
+    return false;
+  }
+
+  budget = cache.num_frames / 2;
+  i = 0;
+  while (i < count && budget) {
+    if (cache_lookup(blocknum + i)) {
+      i++;
+      continue;
+    }
+
+    // claim a frame for each block of the run, pinned so the CLOCK
+    // doesn't hand the same frame out twice
+    n = 0;
+    while (i + n < count && n < MAX_RUN_BLOCKS && n < budget && ! cache_lookup(blocknum + i + n)) {
+      if (! cache_evict(&run[n])) {
+	break;
+      }
+      if (! run[n]) {
+	break;
+      }
+      run[n]->pins++;
+      iov[n].iov_base = run[n]->data;
+      iov[n].iov_len = SOFTWARE_DISK_BLOCK_SIZE;
+      n++;
+    }
+    if (n == 0) {
+      break;
+    }
+
+    ok = sd_backend_transfer(iov, n, blocknum + i, false);
+    for (j = 0; j < n; j++) {
+      run[j]->pins--;
+      if (ok) {
+	run[j]->blocknum = blocknum + i + j;
+	run[j]->valid = true;
+	run[j]->dirty = false;
+	run[j]->referenced = true;
+	cache.frame_of[blocknum + i + j] = run[j] - cache.frames;
+      }
+    }
+    if (! ok) {
+      return false;
+    }
+    cache.stats.prefetches += n;
+    budget -= n;
+    i += n;
+  }
+  return true;
+}
+
+// writes a block of data from 'buf' at location 'blocknum'.  Blocks
+// are numbered from 0.  The buffer 'buf' must be of size
+// SOFTWARE_DISK_BLOCK_SIZE.  Returns true on success or false on
+// failure.  Always sets global 'sderror'.
+static bool sd_write_block(void *buf, uint16_t blocknum) {
+
+  CacheFrame *f;
+
+  sderror = SD_NONE;
+  if (! sd_open()) {
+    return false;
   }
 
   if (blocknum > NUM_BLOCKS-1) {
@@ -86,13 +714,21 @@ bool write_sd_block(void *buf, uint16_t blocknum) {
     return false;
   }
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fwrite(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
-    sderror = SD_INTERNAL_ERROR;
+  if (sd.backend == SD_BACKEND_MMAP) {
+    return sd_backend_write(buf, blocknum);
+  }
+
+  // write-back: the block reaches the backing store on eviction or sync
+  if (! cache_get(blocknum, false, &f)) {
     return false;
   }
-  
-  fflush(sd.fp);
+  if (! f) {
+    return sd_backend_write(buf, blocknum);
+  }
+  if (f->data != buf) {
+    memcpy(f->data, buf, SOFTWARE_DISK_BLOCK_SIZE);
+  }
+  f->dirty = true;
   return true;
 }
 
@@ -100,41 +736,305 @@ bool write_sd_block(void *buf, uint16_t blocknum) {
 // are numbered from 0.  The buffer 'buf' must be of size
 // SOFTWARE_DISK_BLOCK_SIZE.  Returns true on success or false on failure.
 // Always sets global 'sderror'.
-bool read_sd_block(void *buf, uint16_t blocknum) {
+static bool sd_read_block(void *buf, uint16_t blocknum) {
+
+  CacheFrame *f;
 
   sderror = SD_NONE;
-  if (! sd.fp) {
-    sd.fp = fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
-      sderror = SD_INTERNAL_ERROR;
-      return false;
-    }
-    else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp = NULL;
-	sderror = SD_NOT_INIT;
-	return false;
-      }
-    }
+  if (! sd_open()) {
+    return false;
+  }
+
+  if (blocknum > NUM_BLOCKS - 1) {
+    sderror = SD_ILLEGAL_BLOCK_NUMBER;
+    return false;
+  }
+
+  if (sd.backend == SD_BACKEND_MMAP) {
+    return sd_backend_read(buf, blocknum);
+  }
+
+  if (! cache_get(blocknum, true, &f)) {
+    return false;
+  }
+  if (! f) {
+    return sd_backend_read(buf, blocknum);
+  }
+  memcpy(buf, f->data, SOFTWARE_DISK_BLOCK_SIZE);
+  return true;
+}
+
+// pins block 'blocknum' and returns a pointer to its
+// SOFTWARE_DISK_BLOCK_SIZE bytes, so callers can parse and update
+// on-disk structures in place.  With SD_BACKEND_MMAP the pointer is
+// into the mapping, otherwise into a pinned buffer shared by all pins
+// of the same block.  The pointer is valid until the matching
+// unpin_sd_block().  Returns NULL on failure.  Always sets global
+// 'sderror'.
+static void *sd_pin_block(uint16_t blocknum) {
+
+  CacheFrame *f;
+
+  sderror = SD_NONE;
+  if (! sd_open()) {
+    return NULL;
   }
 
   if (blocknum > NUM_BLOCKS - 1) {
     sderror = SD_ILLEGAL_BLOCK_NUMBER;
+    return NULL;
+  }
+
+  if (sd.backend == SD_BACKEND_MMAP) {
+    return sd.map + (size_t)blocknum * SOFTWARE_DISK_BLOCK_SIZE;
+  }
+
+  if (! cache_get(blocknum, true, &f)) {
+    return NULL;
+  }
+  if (! f) {
+    sderror = SD_TOO_MANY_PINS;
+    return NULL;
+  }
+  f->pins++;
+  return f->data;
+}
+
+// records that the pinned block 'blocknum' was modified through the
+// pointer returned by pin_sd_block().  Returns true on success or
+// false on failure.  Always sets global 'sderror'.
+static bool sd_mark_block_dirty(uint16_t blocknum) {
+
+  CacheFrame *f;
+
+  sderror = SD_NONE;
+  if (sd.backend == SD_BACKEND_MMAP) {
+    return true;
+  }
+
+  if (blocknum > NUM_BLOCKS - 1 || ! (f = cache_lookup(blocknum)) || ! f->pins) {
+    sderror = SD_BLOCK_NOT_PINNED;
+    return false;
+  }
+  f->dirty = true;
+  return true;
+}
+
+// releases one pin on block 'blocknum'.  A dirty block stays in the
+// cache until it is evicted or flushed.  Returns true on success or
+// false on failure.  Always sets global 'sderror'.
+static bool sd_unpin_block(uint16_t blocknum) {
+
+  CacheFrame *f;
+
+  sderror = SD_NONE;
+  if (sd.backend == SD_BACKEND_MMAP) {
+    return true;
+  }
+
+  if (blocknum > NUM_BLOCKS - 1 || ! (f = cache_lookup(blocknum)) || ! f->pins) {
+    sderror = SD_BLOCK_NOT_PINNED;
     return false;
   }
+  f->pins--;
+  return true;
+}
+
+// flushes all blocks written so far to stable storage (msync for
+// SD_BACKEND_MMAP, fsync for the file backends).  This is the only
+// barrier: no write is ordered before another one unless a sync is
+// between them.  Returns true on success or false on failure.  Always
+// sets global 'sderror'.
+static bool sd_sync(void) {
+
+  sderror = SD_NONE;
+  if (! sd_open()) {
+    return false;
+  }
+
+  if (! cache_flush()) {
+    return false;
+  }
+
+  switch (sd.backend) {
+  case SD_BACKEND_PREAD:
+    if (fsync(sd.fd)) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    return true;
+  case SD_BACKEND_MMAP:
+    if (msync(sd.map, DISK_BYTES, MS_SYNC)) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    return true;
+  default:
+    if (fflush(sd.fp) || fsync(fileno(sd.fp))) {
+      sderror = SD_INTERNAL_ERROR;
+      return false;
+    }
+    return true;
+  }
+}
+
+// sets the number of blocks held in the block cache, writing back
+// dirty blocks first.  'numblocks' must be at least 1 and no blocks
+// may be pinned.  Returns true on success or false on failure.  Always
+// sets global 'sderror'.
+static bool sd_set_cache_size(uint32_t numblocks) {
+
+  uint32_t i;
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fread(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+  sderror = SD_NONE;
+  if (numblocks < 1) {
     sderror = SD_INTERNAL_ERROR;
     return false;
   }
-  
-  fflush(sd.fp);
+  if (cache.frames) {
+    for (i = 0; i < cache.num_frames; i++) {
+      if (cache.frames[i].pins) {
+	sderror = SD_TOO_MANY_PINS;
+	return false;
+      }
+    }
+    if (sd_is_open() && ! cache_flush()) {
+      return false;
+    }
+    cache_drop();
+  }
+  cache.num_frames = numblocks;
   return true;
 }
 
+// copies the block cache counters into 'stats'
+void software_disk_cache_stats(SDCacheStats *stats) {
+
+  pthread_mutex_lock(&sd_lock);
+  *stats = cache.stats;
+  pthread_mutex_unlock(&sd_lock);
+}
+
+//
+// LOCKED ENTRY POINTS
+//
+// Each takes 'sd_lock' around the unlocked implementation above.
+// A pinned block stays valid after the call returns since pinned
+// frames are never evicted; callers serialize their own updates to
+// the pinned bytes.
+//
+
+bool init_software_disk(void) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_init();
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+// same as init_software_disk(), but first selects 'backend' for all
+// subsequent block access.  Returns true on success, otherwise
+// false. Always sets global 'sderror'.
+bool init_software_disk_backend(SDBackend backend) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  sd_set_backend(backend);
+  ok = sd_init();
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+void set_software_disk_backend(SDBackend backend) {
+
+  pthread_mutex_lock(&sd_lock);
+  sd_set_backend(backend);
+  pthread_mutex_unlock(&sd_lock);
+}
+
+bool prefetch_sd_blocks(uint16_t blocknum, uint16_t count) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_prefetch(blocknum, count);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+bool write_sd_block(void *buf, uint16_t blocknum) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_write_block(buf, blocknum);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+bool read_sd_block(void *buf, uint16_t blocknum) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_read_block(buf, blocknum);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+void *pin_sd_block(uint16_t blocknum) {
+
+  void *data;
+
+  pthread_mutex_lock(&sd_lock);
+  data = sd_pin_block(blocknum);
+  pthread_mutex_unlock(&sd_lock);
+  return data;
+}
+
+bool mark_sd_block_dirty(uint16_t blocknum) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_mark_block_dirty(blocknum);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+bool unpin_sd_block(uint16_t blocknum) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_unpin_block(blocknum);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+bool sync_software_disk(void) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_sync();
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
+bool set_software_disk_cache_size(uint32_t numblocks) {
+
+  bool ok;
+
+  pthread_mutex_lock(&sd_lock);
+  ok = sd_set_cache_size(numblocks);
+  pthread_mutex_unlock(&sd_lock);
+  return ok;
+}
+
 // describe current software disk error code by printing a descriptive
 // message to standard error.
 void sd_print_error(void) {
@@ -151,10 +1051,16 @@ void sd_print_error(void) {
   case SD_INTERNAL_ERROR:
     printf("SD: Internal error, software disk unusable.\n");
     break;
+  case SD_BLOCK_NOT_PINNED:
+    printf("SD: Block is not pinned.\n");
+    break;
+  case SD_TOO_MANY_PINS:
+    printf("SD: Too many pinned blocks.\n");
+    break;
   default:
     printf("SD: Unknown error code %d.\n", sderror);
   }
 }
 
 // software disk  error code set (set by each software disk function).
-SDError sderror;
+_Thread_local SDError sderror;
@@ -19,24 +19,77 @@ typedef enum  {
   SD_NONE,
   SD_NOT_INIT,               // software disk not initialized
   SD_ILLEGAL_BLOCK_NUMBER,   // specified block number exceeds size of software disk
-  SD_INTERNAL_ERROR          // the software disk has failed
+  SD_INTERNAL_ERROR,         // the software disk has failed
+  SD_BLOCK_NOT_PINNED,       // dirty/unpin of a block that isn't pinned
+  SD_TOO_MANY_PINS           // no buffer left to pin another block
 } SDError;
 
-// function prototypes for software disk API
+// backing store access methods.  SD_BACKEND_STDIO is the original
+// fseek + fread/fwrite implementation, buffered by stdio.
+// SD_BACKEND_PREAD uses positional pread/pwrite on a file descriptor
+// and keeps no shared seek state.  Neither flushes per block.
+// SD_BACKEND_MMAP maps the whole backing store into memory so block
+// reads and writes are memcpy's; data reaches the backing store when
+// the kernel writes back the mapping or on sync_software_disk().
+typedef enum {
+  SD_BACKEND_STDIO,
+  SD_BACKEND_PREAD,
+  SD_BACKEND_MMAP
+} SDBackend;
+
+// counters kept by the block cache that sits between the block API
+// and the stdio/pread backends
+typedef struct {
+  uint64_t hits;        // reads, writes and pins served from the cache
+  uint64_t misses;      // ... that had to claim a frame
+  uint64_t evictions;   // blocks dropped to make room
+  uint64_t writebacks;  // dirty blocks written to the backing store
+  uint64_t prefetches;  // blocks read in ahead of use by prefetch_sd_blocks()
+} SDCacheStats;
+
+// one block of a scattered transfer for read_sd_blockv() and
+// write_sd_blockv()
+typedef struct {
+  uint16_t blocknum;  // block to read or write
+  void *buf;          // SOFTWARE_DISK_BLOCK_SIZE bytes
+} SDBlockVec;
+
+// function prototypes for software disk API.  All of them may be
+// called from several threads at once; each call holds a single
+// software disk lock while it runs.  Concurrent updates to the same
+// pinned block must be serialized by the caller.
 
 // initializes the software disk to all zeros, destroying any existing
-// data.  Returns true on success, otherwise false. Always sets global
-// 'sderror'.
+// data.  The backing store is created sparse, so this takes about the
+// same time whatever the size of the disk.  Returns true on success,
+// otherwise false. Always sets global 'sderror'.
 bool init_software_disk();
 
+// same as init_software_disk(), but first selects 'backend' for all
+// subsequent block access.  Returns true on success, otherwise
+// false. Always sets global 'sderror'.
+bool init_software_disk_backend(SDBackend backend);
+
+// selects 'backend' for accessing an already initialized software
+// disk, closing the backing store if it is currently open.  The next
+// block read or write reopens it with the new backend.  Must not be
+// called while blocks are pinned.
+void set_software_disk_backend(SDBackend backend);
+
+// returns the backend currently selected for the software disk
+SDBackend software_disk_backend(void);
+
 // returns the size of the SoftwareDisk in multiples of
 // SOFTWARE_DISK_BLOCK_SIZE
 uint16_t software_disk_size();
 
 // writes a block of data from 'buf' at location 'blocknum'.  Blocks
 // are numbered from 0.  The buffer 'buf' must be of size
-// SOFTWARE_DISK_BLOCK_SIZE.  Returns true on success or false on failure.
-// Always sets global 'sderror'.
+// SOFTWARE_DISK_BLOCK_SIZE.  Except with SD_BACKEND_MMAP, the block
+// goes into the block cache and reaches the backing store when it is
+// evicted, on sync_software_disk() or at program exit.  It is only
+// durable after the next sync_software_disk().  Returns true on success
+// or false on failure.  Always sets global 'sderror'.
 bool write_sd_block(void *buf, uint16_t blocknum);
 
 // reads a block of data into 'buf' from location 'blocknum'.  Blocks
@@ -45,10 +98,82 @@ bool write_sd_block(void *buf, uint16_t blocknum);
 // failure.  Always sets global 'sderror'.
 bool read_sd_block(void *buf, uint16_t blocknum);
 
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf',
+// which must hold count * SOFTWARE_DISK_BLOCK_SIZE bytes.  Blocks in
+// the block cache are copied from it and each run of the others is
+// read with a single preadv (or one copy from the mapping), without
+// passing through the cache.  Returns true on success or false on
+// failure.  Always sets global 'sderror'.
+bool read_sd_blocks(void *buf, uint16_t blocknum, uint16_t count);
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf',
+// which must hold count * SOFTWARE_DISK_BLOCK_SIZE bytes.  Blocks in
+// the block cache are updated there and each run of the others is
+// written straight to the backing store with a single pwritev.
+// Returns true on success or false on failure.  Always sets global
+// 'sderror'.
+bool write_sd_blocks(void *buf, uint16_t blocknum, uint16_t count);
+
+// same as read_sd_blocks() for a scatter list of 'count' (blocknum,
+// buffer) pairs.  Entries for consecutive blocks are read together.
+bool read_sd_blockv(SDBlockVec *vec, uint32_t count);
+
+// same as write_sd_blocks() for a scatter list of 'count' (blocknum,
+// buffer) pairs.  Entries for consecutive blocks are written together.
+bool write_sd_blockv(SDBlockVec *vec, uint32_t count);
+
+// reads up to 'count' consecutive blocks starting at 'blocknum' into
+// the block cache ahead of use, so later reads of them are served from
+// memory.  Blocks already cached are skipped and each run of the others
+// is read with a single preadv.  Stops early rather than evict more
+// than half the cache.  Does nothing with SD_BACKEND_MMAP.  Returns
+// true on success or false on failure.  Always sets global 'sderror'.
+bool prefetch_sd_blocks(uint16_t blocknum, uint16_t count);
+
+// pins block 'blocknum' and returns a pointer to its
+// SOFTWARE_DISK_BLOCK_SIZE bytes, so callers can parse and update
+// on-disk structures in place.  With SD_BACKEND_MMAP the pointer is
+// into the mapping, otherwise into a pinned buffer shared by all pins
+// of the same block.  The pointer is valid until the matching
+// unpin_sd_block().  Returns NULL on failure.  Always sets global
+// 'sderror'.
+void *pin_sd_block(uint16_t blocknum);
+
+// records that the pinned block 'blocknum' was modified through the
+// pointer returned by pin_sd_block().  Returns true on success or
+// false on failure.  Always sets global 'sderror'.
+bool mark_sd_block_dirty(uint16_t blocknum);
+
+// releases one pin on block 'blocknum'.  When the last pin is
+// released the block may be evicted from the block cache again, with a
+// dirty block being written back first.  Returns true on success or
+// false on failure.  Always sets global 'sderror'.
+bool unpin_sd_block(uint16_t blocknum);
+
+// flushes all blocks written so far to stable storage, writing back
+// dirty cached blocks and then calling msync for SD_BACKEND_MMAP or
+// fsync for the file backends.  It is also the only write barrier:
+// blocks written before it reach the disk before any block written
+// after it, otherwise writes reach the disk in no particular order.
+// Returns true on success or false on failure.  Always sets global
+// 'sderror'.
+bool sync_software_disk(void);
+
+// sets the number of blocks held in the block cache, writing back
+// dirty blocks first.  'numblocks' must be at least 1 and no blocks
+// may be pinned.  Returns true on success or false on failure.  Always
+// sets global 'sderror'.
+bool set_software_disk_cache_size(uint32_t numblocks);
+
+// copies the block cache hit/miss/eviction/writeback counters into
+// 'stats'
+void software_disk_cache_stats(SDCacheStats *stats);
+
 // describe current software disk error code by printing a descriptive
 // message to standard error
 void sd_print_error(void);
 
 // software disk  error code set (set by each software disk function).
-extern SDError sderror;
+// Each thread has its own, describing the last call that thread made.
+extern _Thread_local SDError sderror;
 #endif
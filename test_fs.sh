@@ -6,6 +6,11 @@ gcc -g -o testfs2 testfs2.c filesystem.c softwaredisk.c && ./formatfs && ./testf
 gcc -g -o testfs3 testfs3.c filesystem.c softwaredisk.c && ./formatfs && ./testfs3
 gcc -g -o testfs4a testfs4a.c filesystem.c softwaredisk.c && gcc -g -o testfs4b testfs4b.c filesystem.c softwaredisk.c && ./formatfs && ./testfs4a && ./testfs4b
 gcc -g -o testfs5a testfs5a.c filesystem.c softwaredisk.c && gcc -g -o testfs5b testfs5b.c filesystem.c softwaredisk.c && ./formatfs && ./testfs5a && ./testfs5b
+gcc -g -o testfs6 testfs6.c filesystem.c softwaredisk.c && ./formatfs && ./testfs6
+gcc -g -o testfs7 testfs7.c filesystem.c softwaredisk.c && ./formatfs && ./testfs7
+gcc -g -pthread -o testfs8 testfs8.c filesystem.c softwaredisk.c && ./formatfs && ./testfs8
+gcc -g -o testfs9 testfs9.c filesystem.c softwaredisk.c && ./formatfs && ./testfs9
+gcc -g -pthread -o testfs10 testfs10.c filesystem.c softwaredisk.c && ./formatfs && ./testfs10
 
 # ONLY if your implementation is thread safe!
-# gcc -g -o testfs-threads testfs-threads.c filesystem.c softwaredisk.c && ./formatfs && ./testfs-threads
\ No newline at end of file
+gcc -g -pthread -o testfs-threads testfs-threads.c filesystem.c softwaredisk.c && ./formatfs && ./testfs-threads
\ No newline at end of file
@@ -0,0 +1,119 @@
+//
+// This is a standalone test.  RUN formatfs before conducting this
+// test!  A child process writes files and makes them durable with
+// fs_sync() and with sync_file() from several threads at once, then
+// exits without writing anything else back, like a crash.  Every
+// synced file must be there with all of its data afterwards.
+//
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "filesystem.h"
+
+#define NUM_THREADS 4
+#define FILE_BYTES 5000
+
+// the contents of file n
+void fill(unsigned char *buf, int n) {
+  int i;
+  for (i = 0; i < FILE_BYTES; i++) {
+    buf[i] = (n * 11 + i) % 253;
+  }
+}
+
+// creates file name with the contents of file n, left open
+File make(char *name, int n) {
+  unsigned char buf[FILE_BYTES];
+  File f;
+
+  f = create_file(name);
+  if (! f) {
+    return NULL;
+  }
+  fill(buf, n);
+  if (write_file(f, buf, FILE_BYTES) != FILE_BYTES) {
+    return NULL;
+  }
+  return f;
+}
+
+// each thread writes its own file and syncs it, sharing commits with
+// the others
+void *thread(void *args) {
+
+  int id = (int)(intptr_t)args;
+  char name[64];
+  File f;
+
+  sprintf(name, "synced-thread-%d", id);
+  f = make(name, id);
+  if (! f || ! sync_file(f)) {
+    return "sync";
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned char expected[FILE_BYTES], buf[FILE_BYTES];
+  pthread_t threads[NUM_THREADS];
+  char name[64];
+  int i, status;
+  void *result;
+  pid_t pid;
+  File f;
+
+  pid = fork();
+  if (pid == 0) {
+    // still open and in the write buffer when fs_sync() is called
+    if (! make("synced-all", NUM_THREADS) || fs_sync() != FS_NONE) {
+      _exit(1);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+      pthread_create(&threads[i], NULL, thread, (void *)(intptr_t)i);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+      pthread_join(threads[i], &result);
+      if (result) {
+	_exit(1);
+      }
+    }
+    // never synced, may or may not survive
+    make("unsynced", NUM_THREADS + 1);
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+  if (! WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("Child failed.\n");
+    goto fail;
+  }
+
+  for (i = 0; i <= NUM_THREADS; i++) {
+    if (i < NUM_THREADS) {
+      sprintf(name, "synced-thread-%d", i);
+    }
+    else {
+      strcpy(name, "synced-all");
+    }
+    f = open_file(name, READ_ONLY);
+    if (! f) {
+      printf("File %s didn't survive.\n", name);
+      goto fail;
+    }
+    fill(expected, i);
+    if (file_length(f) != FILE_BYTES || read_file(f, buf, FILE_BYTES) != FILE_BYTES ||
+	memcmp(buf, expected, FILE_BYTES)) {
+      printf("File %s doesn't match.\n", name);
+      goto fail;
+    }
+    close_file(f);
+    delete_file(name);
+  }
+  printf("Synced files survived the crash.\n");
+  return 0;
+
+ fail:
+  printf("FAIL.\n");
+  return 1;
+}
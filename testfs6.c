@@ -0,0 +1,86 @@
+//
+// This is a standalone test.  RUN formatfs before conducting this
+// test!  This test writes binary data, including zero bytes, in
+// pieces that start and end in the middle of blocks, then overwrites
+// part of it and reads everything back.
+//
+
+#include "filesystem.h"
+
+#define DATA_SIZE (100 * 1024 + 123)
+
+int main(int argc, char *argv[]) {
+
+  uint64_t i, ret, pos;
+  File f;
+  unsigned char *data, *buf;
+
+  data = malloc(DATA_SIZE);
+  buf = malloc(DATA_SIZE);
+  for (i = 0; i < DATA_SIZE; i++) {
+    data[i] = (i * 7 + i / 1024) % 256;   // every byte value, 0 included
+  }
+
+  f = create_file("binary");
+  fs_print_error();
+  if (! f) {
+    goto fail;
+  }
+
+  // odd sized writes so some copies cover whole blocks and some don't
+  for (pos = 0; pos < DATA_SIZE; pos += ret) {
+    uint64_t len = DATA_SIZE - pos < 3001 ? DATA_SIZE - pos : 3001;
+    ret = write_file(f, data + pos, len);
+    if (ret != len) {
+      printf("Short write at %" PRIu64 ": %" PRIu64 " of %" PRIu64 " bytes.\n", pos, ret, len);
+      fs_print_error();
+      goto fail;
+    }
+  }
+  printf("Wrote %" PRIu64 " bytes of binary data.\n", file_length(f));
+
+  // overwrite a stretch that straddles several blocks
+  for (i = 5000; i < 9000; i++) {
+    data[i] = 0;
+  }
+  seek_file(f, 5000);
+  ret = write_file(f, data + 5000, 4000);
+  printf("ret from write_file(f, data + 5000, 4000) = %" PRIu64 "\n", ret);
+  fs_print_error();
+  if (file_length(f) != DATA_SIZE) {
+    printf("Overwrite changed the file length to %" PRIu64 ".\n", file_length(f));
+    goto fail;
+  }
+  close_file(f);
+
+  f = open_file("binary", READ_ONLY);
+  fs_print_error();
+  if (! f) {
+    goto fail;
+  }
+  ret = read_file(f, buf, DATA_SIZE);
+  printf("ret from read_file(f, buf, DATA_SIZE) = %" PRIu64 "\n", ret);
+  fs_print_error();
+  if (ret != DATA_SIZE || memcmp(buf, data, DATA_SIZE)) {
+    printf("Binary data read back doesn't match.\n");
+    goto fail;
+  }
+
+  // unaligned read from the middle
+  seek_file(f, 1023);
+  ret = read_file(f, buf, 2050);
+  if (ret != 2050 || memcmp(buf, data + 1023, 2050)) {
+    printf("Unaligned read doesn't match.\n");
+    goto fail;
+  }
+  close_file(f);
+
+  delete_file("binary");
+  fs_print_error();
+  printf("Binary data matches.\n");
+  return 0;
+
+ fail:
+  printf("FAIL.\n");
+  return 1;
+}
@@ -0,0 +1,105 @@
+//
+// This is a standalone test.  RUN formatfs before conducting this
+// test!  This test opens one file through several handles at once:
+// two readers and a writer, each with its own file position.  A
+// second writer and deleting the open file should both fail.
+//
+
+#include "filesystem.h"
+
+int main(int argc, char *argv[]) {
+
+  char buf[100];
+  uint64_t ret;
+  File w, r1, r2, w2;
+
+  w = create_file("shared");
+  fs_print_error();
+  if (! w) {
+    goto fail;
+  }
+  ret = write_file(w, "0123456789", 10);
+  printf("ret from write_file(w, \"0123456789\", 10) = %" PRIu64 "\n", ret);
+
+  // should succeed, any number of readers next to the writer
+  r1 = open_file("shared", READ_ONLY);
+  fs_print_error();
+  r2 = open_file("shared", READ_ONLY);
+  fs_print_error();
+  if (! r1 || ! r2) {
+    goto fail;
+  }
+
+  // should fail, only one writer
+  w2 = open_file("shared", READ_WRITE);
+  printf("ret from second open_file(\"shared\", READ_WRITE) = %p\n", (void *)w2);
+  fs_print_error();
+  if (w2) {
+    goto fail;
+  }
+
+  // should fail, the file is open
+  ret = delete_file("shared");
+  printf("ret from delete_file(\"shared\") = %d\n", (int)ret);
+  fs_print_error();
+  if (ret) {
+    goto fail;
+  }
+
+  // each reader keeps its own position and sees the buffered write
+  bzero(buf, sizeof(buf));
+  ret = read_file(r1, buf, 4);
+  printf("r1 read \"%s\"\n", buf);
+  if (ret != 4 || strcmp(buf, "0123")) {
+    goto fail;
+  }
+  seek_file(r2, 6);
+  bzero(buf, sizeof(buf));
+  ret = read_file(r2, buf, 10);
+  printf("r2 read \"%s\"\n", buf);
+  if (ret != 4 || strcmp(buf, "6789")) {
+    goto fail;
+  }
+
+  // the writer appends, both readers see the new length
+  ret = write_file(w, "abcdef", 6);
+  printf("ret from write_file(w, \"abcdef\", 6) = %" PRIu64 "\n", ret);
+  bzero(buf, sizeof(buf));
+  ret = read_file(r1, buf, 100);
+  printf("r1 read \"%s\"\n", buf);
+  if (ret != 12 || strcmp(buf, "456789abcdef") || file_length(r2) != 16) {
+    goto fail;
+  }
+
+  // readers can write nothing
+  ret = write_file(r1, "x", 1);
+  fs_print_error();
+  if (ret) {
+    goto fail;
+  }
+
+  // with the writer closed another one can open
+  close_file(w);
+  fs_print_error();
+  w = open_file("shared", READ_WRITE);
+  fs_print_error();
+  if (! w) {
+    goto fail;
+  }
+  close_file(w);
+  close_file(r1);
+  close_file(r2);
+
+  // should succeed now that every handle is closed
+  ret = delete_file("shared");
+  fs_print_error();
+  if (! ret) {
+    goto fail;
+  }
+  printf("Shared opens behave.\n");
+  return 0;
+
+ fail:
+  printf("FAIL.\n");
+  return 1;
+}
@@ -0,0 +1,119 @@
+//
+// This is a standalone test.  RUN formatfs before conducting this
+// test!  Several threads share one READ_WRITE handle and fill their
+// own stripes of a file with write_file_at(), then read every stripe
+// back with read_file_at().  The handle's file position must not move.
+//
+
+#include <pthread.h>
+#include "filesystem.h"
+
+#define NUM_THREADS 4
+#define STRIPE_SIZE 3001   // not a multiple of the block size
+#define NUM_STRIPES 40
+#define FILE_SIZE (STRIPE_SIZE * NUM_STRIPES)
+
+File f;
+
+// the byte that belongs at 'pos'
+unsigned char expected(uint64_t pos) {
+  return (pos * 13 + pos / 4096) % 251;
+}
+
+// each thread writes every NUM_THREADS'th stripe, then checks all of
+// them while the other threads may still be writing theirs
+void *thread(void *args) {
+
+  int id = (int)(intptr_t)args;
+  unsigned char buf[STRIPE_SIZE];
+  uint64_t pos, ret;
+  int s, i;
+
+  for (s = id; s < NUM_STRIPES; s += NUM_THREADS) {
+    pos = (uint64_t)s * STRIPE_SIZE;
+    for (i = 0; i < STRIPE_SIZE; i++) {
+      buf[i] = expected(pos + i);
+    }
+    ret = write_file_at(f, buf, STRIPE_SIZE, pos);
+    if (ret != STRIPE_SIZE) {
+      printf("Thread %d: write_file_at(%" PRIu64 ") = %" PRIu64 "\n", id, pos, ret);
+      fs_print_error();
+      return "write";
+    }
+  }
+  for (s = id; s < NUM_STRIPES; s += NUM_THREADS) {
+    pos = (uint64_t)s * STRIPE_SIZE;
+    ret = read_file_at(f, buf, STRIPE_SIZE, pos);
+    for (i = 0; i < STRIPE_SIZE; i++) {
+      if (ret != STRIPE_SIZE || buf[i] != expected(pos + i)) {
+	printf("Thread %d: stripe %d doesn't match.\n", id, s);
+	return "read";
+      }
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+
+  pthread_t threads[NUM_THREADS];
+  unsigned char *zeros, *buf;
+  uint64_t i, ret;
+  void *result;
+  int failed = 0;
+
+  f = create_file("striped");
+  fs_print_error();
+  if (! f) {
+    goto fail;
+  }
+
+  // write_file_at() can't go past the end of the file, so size it first
+  zeros = calloc(FILE_SIZE, 1);
+  ret = write_file(f, zeros, FILE_SIZE);
+  printf("ret from write_file(f, zeros, FILE_SIZE) = %" PRIu64 "\n", ret);
+  seek_file(f, 100);
+
+  // should fail, past the end of the file
+  ret = write_file_at(f, "x", 1, FILE_SIZE + 1);
+  printf("ret from write_file_at(f, \"x\", 1, FILE_SIZE + 1) = %" PRIu64 "\n", ret);
+  fs_print_error();
+  if (ret) {
+    goto fail;
+  }
+
+  for (i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, thread, (void *)(intptr_t)i);
+  }
+  for (i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], &result);
+    failed |= result != NULL;
+  }
+  if (failed) {
+    goto fail;
+  }
+
+  // the position set by seek_file() is where read_file() picks up
+  buf = malloc(FILE_SIZE);
+  ret = read_file(f, buf, FILE_SIZE);
+  printf("ret from read_file(f, buf, FILE_SIZE) = %" PRIu64 "\n", ret);
+  if (ret != FILE_SIZE - 100 || file_length(f) != FILE_SIZE) {
+    goto fail;
+  }
+  for (i = 0; i < ret; i++) {
+    if (buf[i] != expected(100 + i)) {
+      printf("Byte %" PRIu64 " doesn't match.\n", 100 + i);
+      goto fail;
+    }
+  }
+  close_file(f);
+  delete_file("striped");
+  printf("Positional reads and writes match.\n");
+  free(zeros);
+  free(buf);
+  return 0;
+
+ fail:
+  printf("FAIL.\n");
+  return 1;
+}
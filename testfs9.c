@@ -0,0 +1,231 @@
+//
+// This is a standalone test.  RUN formatfs before conducting this
+// test!  A child process creates and writes files, syncing half way,
+// then exits without writing anything back, like a crash.  After the
+// journal is replayed the files that survived must be the first ones
+// created, at least the synced ones, each with all of its data or
+// none, and new files must not be given blocks the survivors still
+// use.  Before that another child deletes a synced file, writes a new
+// one and crashes before the delete commits; the deleted file must
+// come back intact, since its blocks can't be reused until then.
+//
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include "filesystem.h"
+
+#define NUM_FILES 120   // and as many again after the crash, 256 at most
+#define FILE_BYTES 3000
+#define REUSE_BYTES 102400 // the synced file that is deleted before the crash
+
+// the contents of file n
+void fill(unsigned char *buf, int n) {
+  int i;
+  for (i = 0; i < FILE_BYTES; i++) {
+    buf[i] = (n * 7 + i) % 251;
+  }
+}
+
+// the contents of the files in the delete and reuse crash
+void fill_reuse(unsigned char *buf, int n) {
+  int i;
+  for (i = 0; i < REUSE_BYTES; i++) {
+    buf[i] = (n * 13 + i) % 241;
+  }
+}
+
+// runs 'step' in a child process, false if it failed
+bool in_child(int (*step)(void)) {
+  int status;
+  pid_t pid;
+
+  pid = fork();
+  if (pid == 0) {
+    _exit(step());
+  }
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && ! WEXITSTATUS(status);
+}
+
+// makes "reuse-a" durable
+int reuse_create(void) {
+  static unsigned char buf[REUSE_BYTES];
+  File f;
+
+  f = create_file("reuse-a");
+  if (! f) {
+    return 1;
+  }
+  fill_reuse(buf, 0);
+  write_file(f, buf, REUSE_BYTES);
+  close_file(f);
+  return ! sync_all_files();
+}
+
+// deletes "reuse-a" and writes "reuse-b" in a fresh mount, whose
+// allocator starts at the first data block where reuse-a is, then
+// crashes before anything commits
+int reuse_crash(void) {
+  static unsigned char buf[REUSE_BYTES];
+  File f;
+
+  if (! delete_file("reuse-a")) {
+    return 1;
+  }
+  f = create_file("reuse-b");
+  if (! f) {
+    return 1;
+  }
+  fill_reuse(buf, 1);
+  write_file(f, buf, REUSE_BYTES);
+  close_file(f);
+  return 0;
+}
+
+// true if file name holds exactly what fill_reuse(n) puts there
+bool check_reuse(char *name, int n) {
+  static unsigned char expected[REUSE_BYTES], buf[REUSE_BYTES];
+  uint64_t length, ret;
+  File f;
+
+  f = open_file(name, READ_ONLY);
+  if (! f) {
+    return false;
+  }
+  length = file_length(f);
+  ret = read_file(f, buf, REUSE_BYTES);
+  close_file(f);
+  fill_reuse(expected, n);
+  return length == REUSE_BYTES && ret == REUSE_BYTES && ! memcmp(buf, expected, REUSE_BYTES);
+}
+
+// true if file name holds exactly what fill(n) puts there, or nothing
+// when 'empty' is allowed
+bool check(char *name, int n, bool empty) {
+  unsigned char expected[FILE_BYTES], buf[FILE_BYTES];
+  uint64_t length, ret;
+  File f;
+
+  f = open_file(name, READ_ONLY);
+  if (! f) {
+    return false;
+  }
+  length = file_length(f);
+  ret = read_file(f, buf, FILE_BYTES);
+  close_file(f);
+  if (empty && length == 0) {
+    return true;
+  }
+  fill(expected, n);
+  return length == FILE_BYTES && ret == FILE_BYTES && ! memcmp(buf, expected, FILE_BYTES);
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned char buf[FILE_BYTES];
+  char name[64];
+  int i, status, survivors = 0;
+  pid_t pid;
+  File f;
+
+  if (! in_child(reuse_create) || ! in_child(reuse_crash)) {
+    printf("Delete and reuse child failed.\n");
+    goto fail;
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    for (i = 0; i < NUM_FILES; i++) {
+      sprintf(name, "crash-%d", i);
+      f = create_file(name);
+      if (! f) {
+	_exit(1);
+      }
+      fill(buf, i);
+      write_file(f, buf, FILE_BYTES);
+      close_file(f);
+      if (i == NUM_FILES / 2 - 1 && ! sync_all_files()) {
+	_exit(1);
+      }
+    }
+    // no atexit handlers, so neither the journal nor the block cache
+    // gets written back
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+  if (! WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("Child failed.\n");
+    goto fail;
+  }
+
+  // the surviving files are a prefix of the ones created
+  for (i = 0; i < NUM_FILES; i++) {
+    sprintf(name, "crash-%d", i);
+    if (! file_exists(name)) {
+      break;
+    }
+    if (! check(name, i, true)) {
+      printf("File %s is damaged.\n", name);
+      goto fail;
+    }
+    survivors++;
+  }
+  for (; i < NUM_FILES; i++) {
+    sprintf(name, "crash-%d", i);
+    if (file_exists(name)) {
+      printf("File %s survived but an earlier one didn't.\n", name);
+      goto fail;
+    }
+  }
+  printf("%d of %d files survived the crash.\n", survivors, NUM_FILES);
+
+  // the delete of reuse-a never committed, so it's back with its own
+  // data and reuse-b, if it made it, has its own blocks
+  if (! file_exists("reuse-a") || ! check_reuse("reuse-a", 0)) {
+    printf("File reuse-a is damaged.\n");
+    goto fail;
+  }
+  if (file_exists("reuse-b") && ! check_reuse("reuse-b", 1)) {
+    printf("File reuse-b is damaged.\n");
+    goto fail;
+  }
+  delete_file("reuse-a");
+  delete_file("reuse-b");
+  printf("A file deleted before the crash came back intact.\n");
+  if (survivors < NUM_FILES / 2) {
+    goto fail;
+  }
+
+  // new files get blocks of their own
+  for (i = 0; i < survivors; i++) {
+    sprintf(name, "after-%d", i);
+    f = create_file(name);
+    if (! f) {
+      fs_print_error();
+      goto fail;
+    }
+    fill(buf, NUM_FILES + i);
+    write_file(f, buf, FILE_BYTES);
+    close_file(f);
+  }
+  for (i = 0; i < survivors; i++) {
+    sprintf(name, "crash-%d", i);
+    if (! check(name, i, true)) {
+      printf("File %s was overwritten.\n", name);
+      goto fail;
+    }
+    delete_file(name);
+    sprintf(name, "after-%d", i);
+    if (! check(name, NUM_FILES + i, false)) {
+      printf("File %s doesn't match.\n", name);
+      goto fail;
+    }
+    delete_file(name);
+  }
+  printf("Journal replay is consistent.\n");
+  return 0;
+
+ fail:
+  printf("FAIL.\n");
+  return 1;
+}